@@ -44,8 +44,18 @@
  * but extremely stupid malloc packages.
  */
 
+/*
+ * The engines linked instead of mm.c are scored like the segregated
+ * lists of Part 3, whichever Part the Makefile leaves selected.
+ */
+#if defined(MALLOC_LAB_TLSF) || defined(MALLOC_LAB_BUDDY) || defined(MALLOC_LAB_PAGES)
+#  define MALLOC_LAB_ENGINE
+#endif
+
 #if defined(USE_AUTOLAB)
-#  if defined(MALLOC_LAB_IMPLICIT)
+#  if defined(MALLOC_LAB_ENGINE)
+#    define AVG_LIBC_THRUPUT    15000E3
+#  elif defined(MALLOC_LAB_IMPLICIT)
 #    define AVG_LIBC_THRUPUT      160E3
 #  elif defined(MALLOC_LAB_EXPLICIT)
 #    define AVG_LIBC_THRUPUT      800E3
@@ -53,7 +63,9 @@
 #    define AVG_LIBC_THRUPUT    15000E3
 #  endif
 #else
-#  if defined(MALLOC_LAB_IMPLICIT)
+#  if defined(MALLOC_LAB_ENGINE)
+#    define AVG_LIBC_THRUPUT    18000E3
+#  elif defined(MALLOC_LAB_IMPLICIT)
 #    define AVG_LIBC_THRUPUT      210E3
 #  elif defined(MALLOC_LAB_EXPLICIT)
 #    define AVG_LIBC_THRUPUT     1000E3
@@ -72,7 +84,9 @@
  * This constant is used to determining utility score for various
  * allocators. This is dependent on the type of lab submission
  */
-#if defined(MALLOC_LAB_IMPLICIT)
+#if defined(MALLOC_LAB_ENGINE)
+#define UTIL_MAX_REFERENCE 0.83
+#elif defined(MALLOC_LAB_IMPLICIT)
 #define UTIL_MAX_REFERENCE 0.75
 #elif defined(MALLOC_LAB_EXPLICIT)
 #define UTIL_MAX_REFERENCE 0.75
@@ -7,14 +7,19 @@
  */
 
 #define __STDC_WANT_LIB_EXT2__ 1
+#define _POSIX_C_SOURCE 200809L
+/* For RUSAGE_THREAD */
+#define _GNU_SOURCE
 
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -22,6 +27,7 @@
 #include "fsecs.h"
 #include "memlib.h"
 #include "mm.h"
+#include "mm_lock.h"
 
 /**********************
  * Constants and macros
@@ -32,6 +38,11 @@
 #define HDRLINES 4         /* number of header lines in a trace file */
 #define LINENUM(i) (i + 5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Call latencies are kept in buckets of OP_HIST_NS nanoseconds; the last
+   bucket also holds every call slower than that */
+#define OP_HIST_NS 100
+#define OP_HIST_BUCKETS 1000
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p) ((((unsigned long long)(p)) % ALIGNMENT) == 0)
 
@@ -91,12 +102,84 @@ typedef struct
   int valid;   /* was the trace processed correctly by the allocator? */
   long double secs; /* number of secs needed to run the trace */
 
+  long double pages; /* average number of pages spanned by a payload */
+  long double faults; /* minor page faults the calls took */
+  long double resident; /* heap bytes in memory once the trace is done */
+  long double committed; /* storage memlib had committed by then */
+  long double max_op_secs; /* slowest single malloc/free/realloc call */
+  unsigned long op_hist[OP_HIST_BUCKETS]; /* latencies of those calls */
+
   /* defined only for the student malloc package */
+  long double realloc_secs; /* secs spent inside mm_realloc */
   long double util; /* space utilization for this trace (always 0 for libc) */
 
   /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* Holds the params to the pool and arena benchmarks' xxx_speed functions */
+typedef struct
+{
+  uint32_t size; /* object size */
+  int cache;     /* do the objects need constructing? */
+  void **objs;   /* the objects allocated so far */
+} pool_bench_t;
+
+/* Heap sizes seen by the handle mode (-H) on one trace */
+typedef struct
+{
+  int valid;              /* was the trace processed correctly? */
+  long double live;       /* payload bytes live when the trace starts freeing */
+  long double heap;       /* heap size at that point */
+  long double compacted;  /* heap size after a full compaction pass */
+  unsigned steps;         /* mm_compact calls that pass took */
+  long double incremental; /* heap size there with compaction between ops */
+} handle_stats_t;
+
+/* One trace timed on ordinary and on huge pages (-U) */
+typedef struct
+{
+  int valid;           /* was the trace processed correctly both times? */
+  long double ops;     /* number of ops (malloc/free/realloc) in the trace */
+  long double peak;    /* heap size it peaked at on ordinary pages */
+  long double secs[2]; /* time it took on ordinary and on huge pages */
+  long double thp;     /* transparent huge page bytes in use after it */
+} huge_stats_t;
+
+/* A front end the multi-threaded benchmark (-m) runs */
+typedef struct
+{
+  const char *name;
+  void *(*malloc) (uint32_t size);
+  void (*free) (void *ptr, uint32_t size);
+} mt_front_t;
+
+/* What one run of the multi-threaded benchmark (-m) left behind, sampled
+   once every thread has freed everything */
+typedef struct
+{
+  uint64_t held;                   /* bytes the front end holds */
+  mm_depot_stats_t depot;          /* magazine depot counters */
+  mm_cpu_lock_stats_t front_locks; /* lock counters of the front ends */
+  mm_stats_t engine;               /* the engine's counters, its locks' too */
+  mm_lock_stats_t one_lock;        /* the lock of the one lock front end */
+} mt_sample_t;
+
+/* Holds the params of one thread of the multi-threaded benchmark (-m) */
+typedef struct
+{
+  const mt_front_t *front;   /* front end the thread allocates with */
+  unsigned ops;              /* allocations the thread makes */
+  unsigned seed;             /* seeds the thread's sizes and slots */
+  pthread_barrier_t *done;   /* waited on twice once the thread is done */
+} mt_thread_t;
+
+/* An object of the object cache benchmark */
+typedef struct
+{
+  pthread_mutex_t lock;
+  void *buf; /* buffer allocated by the constructor */
+} bench_obj_t;
+
 /********************
  * Global variables
  *******************/
@@ -105,6 +188,10 @@ static unsigned errors =
   0;               /* number of errs found when running student malloc */
 char msg[MAXLINE]; /* for whenever we need to compose an error message */
 
+/* Pages spanned by the payloads allocated during the last validity check */
+static unsigned long long touched_pages = 0;
+static unsigned long long touched_allocs = 0;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -132,7 +219,7 @@ free_trace (trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int
-eval_libc_valid (trace_t *trace, unsigned tracenum);
+eval_libc_valid (trace_t *trace, unsigned tracenum, stats_t *stats);
 static void
 eval_libc_speed (void *ptr);
 
@@ -141,14 +228,79 @@ eval_libc_speed (void *ptr);
 static int
 eval_mm_valid (trace_t *trace, unsigned tracenum, range_t **ranges);
 static long double
-eval_mm_util (trace_t *trace);
+eval_mm_util (trace_t *trace, stats_t *stats);
 static void
 eval_mm_speed (void *ptr);
 
+/* Pool and object cache micro-benchmarks (-p, -c) */
+static void
+bench_ctor (void *obj, void *arg);
+static void
+bench_dtor (void *obj, void *arg);
+static void *
+bench_alloc (pool_bench_t *bench);
+static void
+bench_free (pool_bench_t *bench, void *obj);
+static void
+eval_pool_speed (void *ptr);
+static void
+eval_pool_mm_speed (void *ptr);
+static void
+pool_bench (uint32_t size, int cache);
+
+/* Arena benchmark (-A) */
+static void
+eval_arena_speed (void *ptr);
+static void
+eval_arena_mm_speed (void *ptr);
+static void
+arena_check (pool_bench_t *bench);
+static void
+arena_bench (uint32_t size);
+
+/* Multi-threaded benchmark (-m) */
+static void *
+mt_worker (void *ptr);
+static long double
+mt_run (unsigned threads, const mt_front_t *front, mt_sample_t *sample);
+static void
+mt_bench (unsigned threads);
+
+#if defined(MM_HANDLES)
+/* Handle mode (-H) */
+static void
+handle_fill (mm_handle_t h, unsigned index, uint32_t from, uint32_t size);
+static int
+handle_check (mm_handle_t h, unsigned index, uint32_t size);
+static int
+eval_mm_handles (trace_t *trace, unsigned tracenum, int interleave,
+                 handle_stats_t *hstats);
+static void
+handle_traces (char **tracefiles, unsigned n);
+#endif
+
+/* Huge page comparison (-U) */
+static long
+anon_huge_kb (void);
+static void
+huge_traces (char **tracefiles, unsigned n);
+
 /* Various helper routines */
+static long double
+op_secs (struct timespec *start, stats_t *stats);
+static long double
+hist_percentile (unsigned long *hist, long double pct);
+static long
+minor_faults (void);
+static void
+count_pages (unsigned char *lo, uint32_t size);
+static long double
+pages_per_alloc (void);
 static void
 printresults (unsigned n, stats_t *stats);
 static void
+printcounters (unsigned n, stats_t *stats, mm_stats_t *counters);
+static void
 usage (void);
 static void
 unix_error (char *msg);
@@ -169,10 +321,24 @@ main (int argc, char **argv)
   range_t *ranges = NULL;      /* keeps track of block extents for one trace */
   stats_t *libc_stats = NULL;  /* libc stats for each trace */
   stats_t *mm_stats = NULL;    /* mm (i.e. student) stats for each trace */
+  mm_stats_t *mm_counters = NULL; /* mm's own counters for each trace */
   speed_t speed_params;        /* input parameters to the xx_speed routines */
 
   int run_libc = 0;   /* If set, run libc malloc (set by -l) */
   int autograder = 0; /* If set, emit summary info for autograder (-g) */
+  int show_counters = 0; /* If set, print mm's own counters (-s) */
+  uint32_t pool_size = 0; /* If set, run the pool benchmark instead (-p) */
+  int cache = 0;          /* If set, construct the pool's objects (-c) */
+  uint32_t arena_size = 0; /* If set, run the arena benchmark instead (-A) */
+  unsigned mt_threads = 0; /* If set, run the multi-threaded benchmark (-m) */
+  unsigned prefault_kb = 0; /* If set, prefault this far past the brk (-w) */
+  int realtime = 0;        /* If set, lock the whole heap in memory (-r) */
+  size_t max_heap_mb = 0;  /* If set, reserve this many MB for the heap (-M) */
+  int huge_pages = 0;      /* If set, back the heap with huge pages (-u) */
+  int huge_compare = 0;    /* If set, time the traces with and without (-U) */
+#if defined(MM_HANDLES)
+  int handle_mode = 0;    /* If set, replay the traces through handles (-H) */
+#endif
 
   /* temporaries used to compute the performance index */
   long double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -182,7 +348,7 @@ main (int argc, char **argv)
      * Read and interpret the command line arguments
      */
   int c;
-  while ((c = getopt (argc, argv, "f:t:hvVgal")) != EOF)
+  while ((c = getopt (argc, argv, "f:t:p:c:A:m:M:b:w:ruUhvVgalsH")) != EOF)
   {
     switch (c)
     {
@@ -204,9 +370,73 @@ main (int argc, char **argv)
         if (tracedir[strlen (tracedir) - 1] != '/')
           strcat (tracedir, "/"); /* path always ends with "/" */
         break;
+      case 'c': /* Benchmark an object cache of objects of this size */
+        cache = 1;
+        /* fall through */
+      case 'p': /* Benchmark a pool of objects of this size */
+        pool_size = (uint32_t)strtoul (optarg, NULL, 10);
+        if (pool_size == 0)
+        {
+          usage ();
+          exit (1);
+        }
+        break;
+      case 'A': /* Benchmark an arena with objects of this size */
+        arena_size = (uint32_t)strtoul (optarg, NULL, 10);
+        if (arena_size == 0)
+        {
+          usage ();
+          exit (1);
+        }
+        break;
+      case 'm': /* Benchmark the per-CPU caches with this many threads */
+        mt_threads = (unsigned)strtoul (optarg, NULL, 10);
+        if (mt_threads == 0)
+        {
+          usage ();
+          exit (1);
+        }
+        break;
+      case 'M': /* Reserve this many MB of address space for the heap */
+        max_heap_mb = (size_t)strtoull (optarg, NULL, 10);
+        break;
+      case 'w': /* Keep pages this many KB past the brk faulted in */
+        prefault_kb = (unsigned)strtoul (optarg, NULL, 10);
+        break;
+      case 'r': /* Lock the whole heap in memory up front */
+        realtime = 1;
+        break;
+      case 'u': /* Back the heap with huge pages */
+        huge_pages = 1;
+        break;
+      case 'U': /* Compare throughput with and without huge pages */
+        huge_compare = 1;
+        break;
       case 'l': /* Run libc malloc */
         run_libc = 1;
         break;
+      case 's': /* Print the allocator's own counters */
+        show_counters = 1;
+        break;
+#if defined(MM_HANDLES)
+      case 'H': /* Replay the traces through handles instead */
+        handle_mode = 1;
+        break;
+#endif
+#if defined(MM_BACKGROUND)
+      case 'b': /* Tune the maintenance thread */
+      {
+        unsigned interval_us = 0;
+        unsigned purge_kb = 64; /* mm.c's own default */
+        if (sscanf (optarg, "%u,%u", &interval_us, &purge_kb) < 1)
+        {
+          usage ();
+          exit (1);
+        }
+        mm_background_tune (interval_us, purge_kb * 1024);
+        break;
+      }
+#endif
       case 'v': /* Print per-trace performance breakdown */
         verbose = 1;
         break;
@@ -222,6 +452,28 @@ main (int argc, char **argv)
     }
   }
 
+  /* Every mem_init from here on reserves that much, in that kind of page */
+  mem_set_max_heap (max_heap_mb << 20);
+  mem_set_huge_pages (huge_pages);
+
+  if (pool_size != 0)
+  {
+    pool_bench (pool_size, cache);
+    exit (0);
+  }
+
+  if (arena_size != 0)
+  {
+    arena_bench (arena_size);
+    exit (0);
+  }
+
+  if (mt_threads != 0)
+  {
+    mt_bench (mt_threads);
+    exit (0);
+  }
+
   /*
      * If no -f command line arg, then use the entire set of tracefiles
      * defined in default_traces[]
@@ -233,9 +485,23 @@ main (int argc, char **argv)
     printf ("Using default tracefiles in %s\n", tracedir);
   }
 
+#if defined(MM_HANDLES)
+  if (handle_mode)
+  {
+    handle_traces (tracefiles, num_tracefiles);
+    exit (errors != 0);
+  }
+#endif
+
   /* Initialize the timing package */
   init_fsecs ();
 
+  if (huge_compare)
+  {
+    huge_traces (tracefiles, num_tracefiles);
+    exit (errors != 0);
+  }
+
   /*
      * Optionally run and evaluate the libc malloc package
      */
@@ -256,9 +522,12 @@ main (int argc, char **argv)
       libc_stats[i].ops = trace->num_ops;
       if (verbose > 1)
         printf ("Checking libc malloc for correctness, ");
-      libc_stats[i].valid = eval_libc_valid (trace, i);
+      long faults = minor_faults ();
+      libc_stats[i].valid = eval_libc_valid (trace, i, &libc_stats[i]);
+      libc_stats[i].faults = (long double)(minor_faults () - faults);
       if (libc_stats[i].valid)
       {
+        libc_stats[i].pages = pages_per_alloc ();
         speed_params.trace = trace;
         if (verbose > 1)
           printf ("and performance.\n");
@@ -285,9 +554,17 @@ main (int argc, char **argv)
   mm_stats = (stats_t *)calloc (num_tracefiles, sizeof (stats_t));
   if (mm_stats == NULL)
     unix_error ("mm_stats calloc in main failed");
+  mm_counters = (mm_stats_t *)calloc (num_tracefiles, sizeof (mm_stats_t));
+  if (mm_counters == NULL)
+    unix_error ("mm_counters calloc in main failed");
 
   /* Initialize the simulated memory system in memlib.c */
   mem_init ();
+  if (prefault_kb != 0)
+    mem_prefault ((size_t)prefault_kb * 1024);
+  if (realtime && mem_lock () != 0)
+    fprintf (stderr, "Warning: couldn't lock the heap into memory: %s\n",
+             strerror (errno));
 
   /* Evaluate student's mm malloc package using the K-best scheme */
   for (unsigned i = 0; i < num_tracefiles; i++)
@@ -299,14 +576,19 @@ main (int argc, char **argv)
     mm_stats[i].valid = eval_mm_valid (trace, i, &ranges);
     if (mm_stats[i].valid)
     {
+      mm_stats[i].pages = pages_per_alloc ();
       if (verbose > 1)
         printf ("efficiency, ");
-      mm_stats[i].util = eval_mm_util (trace);
+      long faults = minor_faults ();
+      mm_stats[i].util = eval_mm_util (trace, &mm_stats[i]);
+      mm_stats[i].faults = (long double)(minor_faults () - faults);
       speed_params.trace = trace;
       speed_params.ranges = ranges;
       if (verbose > 1)
         printf ("and performance.\n");
       mm_stats[i].secs = fsecs (eval_mm_speed, &speed_params);
+      /* The counters now describe the last timed run of this trace */
+      mm_get_stats (&mm_counters[i]);
     }
     free_trace (trace);
   }
@@ -316,6 +598,17 @@ main (int argc, char **argv)
   {
     printf ("\nResults for mm malloc:\n");
     printresults (num_tracefiles, mm_stats);
+    printf ("Reserved %zu KB of address space for the heap%s\n", mem_reserved () / 1024,
+            mem_huge_pages () == MEM_HUGE_TLB   ? ", on hugetlb pages"
+            : mem_huge_pages () == MEM_HUGE_THP ? ", on transparent huge pages"
+                                                : "");
+    printf ("\n");
+  }
+
+  if (show_counters)
+  {
+    printf ("Counters for mm malloc:\n");
+    printcounters (num_tracefiles, mm_stats, mm_counters);
     printf ("\n");
   }
 
@@ -603,6 +896,7 @@ eval_mm_valid (trace_t *trace, unsigned tracenum, range_t **ranges)
   /* Reset the heap and free any records in the range list */
   mem_reset_brk ();
   clear_ranges (ranges);
+  touched_pages = touched_allocs = 0;
 
   /* Call the mm package's init function */
   if (mm_init () < 0)
@@ -636,6 +930,7 @@ eval_mm_valid (trace_t *trace, unsigned tracenum, range_t **ranges)
              */
         if (add_range (ranges, p, size, tracenum, i) == 0)
           return 0;
+        count_pages (p, size);
 
         /* ADDED: cgw
              * fill range with low byte of index.  This will be used later
@@ -665,6 +960,7 @@ eval_mm_valid (trace_t *trace, unsigned tracenum, range_t **ranges)
         /* Check new block for correctness and add it to range list */
         if (add_range (ranges, newp, size, tracenum, i) == 0)
           return 0;
+        count_pages (newp, size);
 
         /* ADDED: cgw
              * Make sure that the new block contains the data from the old
@@ -713,26 +1009,34 @@ eval_mm_valid (trace_t *trace, unsigned tracenum, range_t **ranges)
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest the heap got while running the student's malloc package
+ *   on the trace. mem_sbrk() lets the brk pointer move back down, so
+ *   that is memlib's peak rather than the final size of the heap.
  *
  */
 static long double
-eval_mm_util (trace_t *trace)
+eval_mm_util (trace_t *trace, stats_t *stats)
 {
   uint32_t index;
   uint32_t size, newsize, oldsize;
-  uint32_t max_total_size = 0;
-  uint32_t total_size = 0;
+  size_t max_total_size = 0;
+  size_t total_size = 0;
   unsigned char *p;
   unsigned char *newp, *oldp;
+  struct timespec start;
 
-  /* initialize the heap and the mm malloc package */
+  /* initialize the heap and the mm malloc package, starting from no
+     pages at all so the faults the trace takes can be counted */
+#if defined(MM_BACKGROUND)
+  mm_background_pause (1);
+#endif
   mem_reset_brk ();
+  mem_release ();
   if (mm_init () < 0)
     app_error ("mm_init failed in eval_mm_util");
+#if defined(MM_BACKGROUND)
+  mm_background_pause (0);
+#endif
 
   for (unsigned i = 0; i < trace->num_ops; i++)
   {
@@ -743,8 +1047,10 @@ eval_mm_util (trace_t *trace)
         index = trace->ops[i].index;
         size = trace->ops[i].size;
 
+        clock_gettime (CLOCK_MONOTONIC, &start);
         if ((p = mm_malloc (size)) == NULL)
           app_error ("mm_malloc failed in eval_mm_util");
+        op_secs (&start, stats);
 
         /* Remember region and size */
         trace->blocks[index] = p;
@@ -765,8 +1071,10 @@ eval_mm_util (trace_t *trace)
         oldsize = trace->block_sizes[index];
 
         oldp = trace->blocks[index];
+        clock_gettime (CLOCK_MONOTONIC, &start);
         if ((newp = mm_realloc (oldp, newsize)) == NULL)
           app_error ("mm_realloc failed in eval_mm_util");
+        stats->realloc_secs += op_secs (&start, stats);
 
         /* Remember region and size */
         trace->blocks[index] = newp;
@@ -774,7 +1082,8 @@ eval_mm_util (trace_t *trace)
 
         /* Keep track of current total size
              * of all allocated blocks */
-        total_size += (newsize - oldsize);
+        total_size += newsize;
+        total_size -= oldsize;
 
         /* Update statistics */
         max_total_size =
@@ -786,7 +1095,9 @@ eval_mm_util (trace_t *trace)
         size = trace->block_sizes[index];
         p = trace->blocks[index];
 
+        clock_gettime (CLOCK_MONOTONIC, &start);
         mm_free (p);
+        op_secs (&start, stats);
 
         /* Keep track of current total size
              * of all allocated blocks */
@@ -799,7 +1110,9 @@ eval_mm_util (trace_t *trace)
     }
   }
 
-  return ((double)max_total_size / (double)mem_heapsize ());
+  stats->resident = (long double)mem_resident ();
+  stats->committed = (long double)mem_committed ();
+  return ((double)max_total_size / (double)mem_peak_heapsize ());
 }
 
 /*
@@ -850,6 +1163,812 @@ eval_mm_speed (void *ptr)
     }
 }
 
+/*
+ * The pool benchmark allocates POOL_BENCH_OBJS objects, frees every other
+ * one, allocates those again and then frees them all, POOL_BENCH_ROUNDS
+ * times over, once through mm_pool and once through mm_malloc. With -c the
+ * objects need constructing: each holds a mutex and a zeroed CACHE_BENCH_BUF
+ * byte buffer of its own. The pool is then an object cache, and the
+ * mm_malloc side constructs every object it allocates and destroys every
+ * object it frees.
+ */
+#define POOL_BENCH_OBJS 100000
+#define POOL_BENCH_ROUNDS 4
+#define CACHE_BENCH_BUF 256
+
+static void
+bench_ctor (void *obj, void *arg)
+{
+  bench_obj_t *o = (bench_obj_t *)obj;
+  (void)arg;
+  pthread_mutex_init (&o->lock, NULL);
+  if ((o->buf = mm_malloc (CACHE_BENCH_BUF)) == NULL)
+    app_error ("mm_malloc failed in bench_ctor");
+  memset (o->buf, 0, CACHE_BENCH_BUF);
+}
+
+static void
+bench_dtor (void *obj, void *arg)
+{
+  bench_obj_t *o = (bench_obj_t *)obj;
+  (void)arg;
+  mm_free (o->buf);
+  pthread_mutex_destroy (&o->lock);
+}
+
+static void
+eval_pool_speed (void *ptr)
+{
+  pool_bench_t *bench = (pool_bench_t *)ptr;
+  unsigned i, round;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+    app_error ("mm_init failed in eval_pool_speed");
+  mm_pool_t *pool = bench->cache ? mm_pool_create_cache (bench->size, 0, bench_ctor, bench_dtor, NULL)
+                                  : mm_pool_create (bench->size, 0);
+  if (pool == NULL)
+    app_error ("mm_pool_create failed in eval_pool_speed");
+  for (round = 0; round < POOL_BENCH_ROUNDS; round++)
+  {
+    for (i = 0; i < POOL_BENCH_OBJS; i++)
+      if ((bench->objs[i] = mm_pool_alloc (pool)) == NULL)
+        app_error ("mm_pool_alloc failed in eval_pool_speed");
+    for (i = 0; i < POOL_BENCH_OBJS; i += 2)
+      mm_pool_free (pool, bench->objs[i]);
+    for (i = 0; i < POOL_BENCH_OBJS; i += 2)
+      if ((bench->objs[i] = mm_pool_alloc (pool)) == NULL)
+        app_error ("mm_pool_alloc failed in eval_pool_speed");
+    for (i = 0; i < POOL_BENCH_OBJS; i++)
+      mm_pool_free (pool, bench->objs[i]);
+  }
+  mm_pool_destroy (pool);
+}
+
+/*
+ * bench_alloc, bench_free - mm_malloc and mm_free, constructing and destroying the
+ *     object when the benchmark needs constructed objects
+ */
+static void *
+bench_alloc (pool_bench_t *bench)
+{
+  void *obj = mm_malloc (bench->size);
+  if (obj == NULL)
+    app_error ("mm_malloc failed in eval_pool_mm_speed");
+  if (bench->cache)
+    bench_ctor (obj, NULL);
+  return obj;
+}
+
+static void
+bench_free (pool_bench_t *bench, void *obj)
+{
+  if (bench->cache)
+    bench_dtor (obj, NULL);
+  mm_free (obj);
+}
+
+static void
+eval_pool_mm_speed (void *ptr)
+{
+  pool_bench_t *bench = (pool_bench_t *)ptr;
+  unsigned i, round;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+    app_error ("mm_init failed in eval_pool_mm_speed");
+  for (round = 0; round < POOL_BENCH_ROUNDS; round++)
+  {
+    for (i = 0; i < POOL_BENCH_OBJS; i++)
+      bench->objs[i] = bench_alloc (bench);
+    for (i = 0; i < POOL_BENCH_OBJS; i += 2)
+      bench_free (bench, bench->objs[i]);
+    for (i = 0; i < POOL_BENCH_OBJS; i += 2)
+      bench->objs[i] = bench_alloc (bench);
+    for (i = 0; i < POOL_BENCH_OBJS; i++)
+      bench_free (bench, bench->objs[i]);
+  }
+}
+
+/*
+ * pool_bench - times the pool benchmark for objects of size bytes, which
+ *     need constructing if cache is set, and prints the throughput of
+ *     mm_pool and of mm_malloc
+ */
+static void
+pool_bench (uint32_t size, int cache)
+{
+  pool_bench_t bench;
+  long double ops = 3 * POOL_BENCH_OBJS * POOL_BENCH_ROUNDS;
+  long double pool_secs, mm_secs;
+
+  if (cache && size < sizeof (bench_obj_t))
+    size = sizeof (bench_obj_t);
+  bench.size = size;
+  bench.cache = cache;
+  bench.objs = (void **)calloc (POOL_BENCH_OBJS, sizeof (void *));
+  if (bench.objs == NULL)
+    unix_error ("objs calloc in pool_bench failed");
+  init_fsecs ();
+  mem_init ();
+  /* Run both once first, so neither pays for faulting in the heap */
+  eval_pool_speed (&bench);
+  eval_pool_mm_speed (&bench);
+  pool_secs = fsecs (eval_pool_speed, &bench);
+  mm_secs = fsecs (eval_pool_mm_speed, &bench);
+  printf ("%s benchmark, %u byte objects, %.0Lf ops:\n", cache ? "Object cache" : "Pool", size, ops);
+  printf ("%15s%12s\n", "", "Kops");
+  printf ("%15s%12.0Lf\n", cache ? "mm_pool cache" : "mm_pool", ops / pool_secs / 1e3);
+  printf ("%15s%12.0Lf\n", cache ? "mm_malloc+ctor" : "mm_malloc", ops / mm_secs / 1e3);
+  free (bench.objs);
+}
+
+/*
+ * The arena benchmark allocates ARENA_BENCH_OBJS objects from an arena
+ * ARENA_BENCH_ROUNDS times over. Each round takes a mark halfway, releases
+ * the second half back to it and allocates that half again, then resets the
+ * arena. The mm_malloc side allocates the same objects and frees the ones
+ * the arena gives back. Throughput counts allocations only, since the arena
+ * frees in bulk.
+ */
+#define ARENA_BENCH_OBJS 100000
+#define ARENA_BENCH_ROUNDS 4
+
+static void
+eval_arena_speed (void *ptr)
+{
+  pool_bench_t *bench = (pool_bench_t *)ptr;
+  unsigned i, round;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+    app_error ("mm_init failed in eval_arena_speed");
+  mm_arena_t *arena = mm_arena_create (0);
+  if (arena == NULL)
+    app_error ("mm_arena_create failed in eval_arena_speed");
+  for (round = 0; round < ARENA_BENCH_ROUNDS; round++)
+  {
+    for (i = 0; i < ARENA_BENCH_OBJS / 2; i++)
+      if ((bench->objs[i] = mm_arena_alloc (arena, bench->size)) == NULL)
+        app_error ("mm_arena_alloc failed in eval_arena_speed");
+    mm_arena_mark_t mark = mm_arena_mark (arena);
+    for (i = ARENA_BENCH_OBJS / 2; i < ARENA_BENCH_OBJS; i++)
+      if ((bench->objs[i] = mm_arena_alloc (arena, bench->size)) == NULL)
+        app_error ("mm_arena_alloc failed in eval_arena_speed");
+    mm_arena_release (arena, mark);
+    for (i = ARENA_BENCH_OBJS / 2; i < ARENA_BENCH_OBJS; i++)
+      if ((bench->objs[i] = mm_arena_alloc (arena, bench->size)) == NULL)
+        app_error ("mm_arena_alloc failed in eval_arena_speed");
+    mm_arena_reset (arena);
+  }
+  mm_arena_destroy (arena);
+}
+
+static void
+eval_arena_mm_speed (void *ptr)
+{
+  pool_bench_t *bench = (pool_bench_t *)ptr;
+  unsigned i, round;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+    app_error ("mm_init failed in eval_arena_mm_speed");
+  for (round = 0; round < ARENA_BENCH_ROUNDS; round++)
+  {
+    for (i = 0; i < ARENA_BENCH_OBJS; i++)
+      bench->objs[i] = bench_alloc (bench);
+    for (i = ARENA_BENCH_OBJS / 2; i < ARENA_BENCH_OBJS; i++)
+      bench_free (bench, bench->objs[i]);
+    for (i = ARENA_BENCH_OBJS / 2; i < ARENA_BENCH_OBJS; i++)
+      bench->objs[i] = bench_alloc (bench);
+    for (i = 0; i < ARENA_BENCH_OBJS; i++)
+      bench_free (bench, bench->objs[i]);
+  }
+}
+
+/*
+ * arena_check - runs one round of the arena benchmark with every object
+ *     stamped, and makes sure objects are aligned and don't overlap, that
+ *     release and reset hand the same memory out again, and that sizes
+ *     too big for a chunk fail
+ */
+static void
+arena_check (pool_bench_t *bench)
+{
+  unsigned i;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+    app_error ("mm_init failed in arena_check");
+  mm_arena_t *arena = mm_arena_create (0);
+  if (arena == NULL)
+    app_error ("mm_arena_create failed in arena_check");
+  if (mm_arena_alloc (arena, UINT32_MAX) != NULL
+      || mm_arena_alloc (arena, UINT32_MAX - ALIGNMENT) != NULL)
+    app_error ("mm_arena_alloc didn't fail for a size too big for a chunk");
+  for (i = 0; i < ARENA_BENCH_OBJS; i++)
+  {
+    if ((bench->objs[i] = mm_arena_alloc (arena, bench->size)) == NULL)
+      app_error ("mm_arena_alloc failed in arena_check");
+    if (!IS_ALIGNED (bench->objs[i]))
+      app_error ("mm_arena_alloc returned an unaligned object");
+    memset (bench->objs[i], (int)(i & 0xFF), bench->size);
+  }
+  for (i = 0; i < ARENA_BENCH_OBJS; i++)
+    for (uint32_t j = 0; j < bench->size; j++)
+      if (((unsigned char *)bench->objs[i])[j] != (unsigned char)i)
+        app_error ("mm_arena_alloc returned overlapping objects");
+
+  void *first = bench->objs[0];
+  void *second_half = bench->objs[ARENA_BENCH_OBJS / 2];
+  mm_arena_reset (arena);
+  for (i = 0; i < ARENA_BENCH_OBJS / 2; i++)
+    bench->objs[i] = mm_arena_alloc (arena, bench->size);
+  if (bench->objs[0] != first)
+    app_error ("mm_arena_reset didn't rewind to the first chunk");
+  mm_arena_mark_t mark = mm_arena_mark (arena);
+  void *at_mark = mm_arena_alloc (arena, bench->size);
+  if (at_mark != second_half)
+    app_error ("mm_arena_alloc didn't reuse the chunks kept by the reset");
+  for (i = 0; i < 3; i++)
+    mm_arena_alloc (arena, bench->size);
+  mm_arena_release (arena, mark);
+  if (mm_arena_alloc (arena, bench->size) != at_mark)
+    app_error ("mm_arena_release didn't rewind to the mark");
+  mm_arena_destroy (arena);
+}
+
+/*
+ * arena_bench - checks the arena, then times the arena benchmark for objects
+ *     of size bytes and prints the throughput of mm_arena and of mm_malloc
+ */
+static void
+arena_bench (uint32_t size)
+{
+  pool_bench_t bench;
+  long double allocs = 1.5 * ARENA_BENCH_OBJS * ARENA_BENCH_ROUNDS;
+  long double arena_secs, mm_secs;
+
+  bench.size = size;
+  bench.cache = 0;
+  bench.objs = (void **)calloc (ARENA_BENCH_OBJS, sizeof (void *));
+  if (bench.objs == NULL)
+    unix_error ("objs calloc in arena_bench failed");
+  init_fsecs ();
+  mem_init ();
+  if ((size_t)size * ARENA_BENCH_OBJS * 2 > mem_reserved ())
+  {
+    printf ("%u byte objects don't fit the heap twice over; -M reserves more\n", size);
+    exit (1);
+  }
+  arena_check (&bench);
+  /* Run both once first, so neither pays for faulting in the heap */
+  eval_arena_speed (&bench);
+  eval_arena_mm_speed (&bench);
+  arena_secs = fsecs (eval_arena_speed, &bench);
+  mm_secs = fsecs (eval_arena_mm_speed, &bench);
+  printf ("Arena benchmark, %u byte objects, %.0Lf allocations:\n", size, allocs);
+  printf ("%15s%12s\n", "", "Kallocs");
+  printf ("%15s%12.0Lf\n", "mm_arena", allocs / arena_secs / 1e3);
+  printf ("%15s%12.0Lf\n", "mm_malloc", allocs / mm_secs / 1e3);
+  free (bench.objs);
+}
+
+/*
+ * The multi-threaded benchmark runs threads that together make MT_OPS
+ * allocations of 16 to MT_MAX_SIZE bytes, each thread keeping MT_WINDOW of
+ * them live and freeing a random one to make room for the next. Every
+ * MT_PHASE of them it also makes a burst of MT_BURST allocations of one size
+ * and frees them all, the traffic magazines are traded with a depot for. It
+ * runs
+ * through the per-CPU caches, per-thread caches and per-thread magazines,
+ * then straight into the engine under one lock and, when the engine locks
+ * its own lists (MM_TLSF_SHARED), with no lock around it, and reports throughput and the bytes left cached once every thread has
+ * freed everything but before any has exited, and how the magazine depots
+ * were used. Built with -DMM_LOCK_STATS, it also reports how often each kind
+ * of lock was taken and how long threads waited for it.
+ */
+#define MT_OPS 2000000
+#define MT_WINDOW 64
+#define MT_MAX_SIZE 512
+#define MT_PHASE 4096
+#define MT_BURST 256
+#define MT_STACK (256 * 1024)
+#define MT_RUNS 3
+
+static pthread_mutex_t mt_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static mm_lock_stats_t mt_heap_lock_stats;
+
+/* mt_locked_malloc, mt_locked_free - the engine under one lock */
+static void *
+mt_locked_malloc (uint32_t size)
+{
+  lockMutex (&mt_heap_lock, &mt_heap_lock_stats);
+  void *p = mm_malloc (size);
+  pthread_mutex_unlock (&mt_heap_lock);
+  return p;
+}
+
+static void
+mt_locked_free (void *ptr, uint32_t size)
+{
+  (void)size;
+  if (ptr == NULL)
+    return;
+  lockMutex (&mt_heap_lock, &mt_heap_lock_stats);
+  mm_free (ptr);
+  pthread_mutex_unlock (&mt_heap_lock);
+}
+
+#if defined(MM_TLSF_SHARED)
+/* mt_shared_malloc, mt_shared_free - the engine, which locks its own lists */
+static void *
+mt_shared_malloc (uint32_t size)
+{
+  return mm_malloc (size);
+}
+
+static void
+mt_shared_free (void *ptr, uint32_t size)
+{
+  (void)size;
+  mm_free (ptr);
+}
+#endif
+
+static const mt_front_t mt_fronts[] = {
+  { "per-CPU", mm_cpu_malloc, mm_cpu_free },
+  { "per-thread", mm_thread_malloc, mm_thread_free },
+  { "magazines", mm_mag_malloc, mm_mag_free },
+  { "one lock", mt_locked_malloc, mt_locked_free },
+#if defined(MM_TLSF_SHARED)
+  { "list locks", mt_shared_malloc, mt_shared_free },
+#endif
+};
+#define MT_FRONTS (sizeof (mt_fronts) / sizeof (mt_fronts[0]))
+
+static void *
+mt_worker (void *ptr)
+{
+  mt_thread_t *arg = (mt_thread_t *)ptr;
+  void *objs[MT_WINDOW] = { NULL };
+  uint32_t sizes[MT_WINDOW] = { 0 };
+  void *burst[MT_BURST];
+  unsigned x = arg->seed | 1;
+
+  for (unsigned i = 0; i < arg->ops; i++)
+  {
+    /* xorshift */
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    unsigned slot = x % MT_WINDOW;
+    uint32_t size = 16 + (x >> 8) % (MT_MAX_SIZE - 15);
+    arg->front->free (objs[slot], sizes[slot]);
+    objs[slot] = arg->front->malloc (size);
+    if (objs[slot] == NULL)
+      app_error ("allocation failed in mt_worker");
+    sizes[slot] = size;
+    if (i % MT_PHASE == MT_PHASE - 1)
+    {
+      for (unsigned j = 0; j < MT_BURST; j++)
+        if ((burst[j] = arg->front->malloc (size)) == NULL)
+          app_error ("allocation failed in mt_worker");
+      for (unsigned j = 0; j < MT_BURST; j++)
+        arg->front->free (burst[j], size);
+    }
+  }
+  for (unsigned slot = 0; slot < MT_WINDOW; slot++)
+    arg->front->free (objs[slot], sizes[slot]);
+  pthread_barrier_wait (arg->done);
+  pthread_barrier_wait (arg->done);
+  return NULL;
+}
+
+/*
+ * mt_run - runs the benchmark once with the given number of threads and
+ *     returns how long it took; sample gets the bytes left in caches and
+ *     the counters
+ */
+static long double
+mt_run (unsigned threads, const mt_front_t *front, mt_sample_t *sample)
+{
+  pthread_t *tids;
+  mt_thread_t *args;
+  pthread_barrier_t done;
+  pthread_attr_t attr;
+  struct timespec start, end;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+    app_error ("mm_init failed in mt_run");
+  mm_cpu_init ();
+  memset (&mt_heap_lock_stats, 0, sizeof (mm_lock_stats_t));
+  tids = (pthread_t *)calloc (threads, sizeof (pthread_t));
+  args = (mt_thread_t *)calloc (threads, sizeof (mt_thread_t));
+  if (tids == NULL || args == NULL)
+    unix_error ("calloc in mt_run failed");
+  pthread_barrier_init (&done, NULL, threads + 1);
+  pthread_attr_init (&attr);
+  pthread_attr_setstacksize (&attr, MT_STACK);
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (unsigned i = 0; i < threads; i++)
+  {
+    args[i].front = front;
+    args[i].ops = MT_OPS / threads;
+    args[i].seed = 2654435761u * (i + 1);
+    args[i].done = &done;
+    if (pthread_create (&tids[i], &attr, mt_worker, &args[i]) != 0)
+      unix_error ("pthread_create in mt_run failed");
+  }
+  pthread_barrier_wait (&done);
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  sample->held = mm_cpu_heap_bytes ();
+  mm_mag_get_stats (&sample->depot);
+  mm_cpu_get_lock_stats (&sample->front_locks);
+  mm_get_stats (&sample->engine);
+  sample->one_lock = mt_heap_lock_stats;
+  pthread_barrier_wait (&done);
+  for (unsigned i = 0; i < threads; i++)
+    pthread_join (tids[i], NULL);
+
+  pthread_attr_destroy (&attr);
+  pthread_barrier_destroy (&done);
+  free (tids);
+  free (args);
+  return (long double)(end.tv_sec - start.tv_sec) +
+         (long double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * mt_bench - runs the multi-threaded benchmark MT_RUNS times through each
+ *     front end and prints the fastest run of each
+ */
+static void
+mt_bench (unsigned threads)
+{
+  unsigned per_thread = MT_OPS / threads;
+  long double ops = 2.0L * threads *
+                    (per_thread + per_thread / MT_PHASE * MT_BURST);
+  long double best[MT_FRONTS];
+  mt_sample_t samples[MT_FRONTS];
+  mm_depot_stats_t depot = { 0 };
+
+  mem_init ();
+  for (unsigned i = 0; i < MT_FRONTS; i++)
+    best[i] = LDBL_MAX;
+  for (int run = 0; run < MT_RUNS; run++)
+    for (unsigned i = 0; i < MT_FRONTS; i++)
+    {
+      mt_sample_t sample;
+      long double secs = mt_run (threads, &mt_fronts[i], &sample);
+      if (secs < best[i])
+      {
+        best[i] = secs;
+        samples[i] = sample;
+      }
+    }
+  printf ("Multi-threaded benchmark, %u threads on %ld CPUs, %.0Lf ops, "
+          "per-CPU caches %s:\n", threads, sysconf (_SC_NPROCESSORS_ONLN),
+          ops, mm_cpu_rseq () ? "use rseq" : "use sched_getcpu and locks");
+  printf ("%12s%12s%12s\n", "", "Kops", "cached KB");
+  for (unsigned i = 0; i < MT_FRONTS; i++)
+    printf ("%12s%12.0Lf%12.0Lf\n", mt_fronts[i].name, ops / best[i] / 1e3,
+            (long double)samples[i].held / 1024);
+  for (unsigned i = 0; i < MT_FRONTS; i++)
+    if (mt_fronts[i].malloc == mm_mag_malloc)
+      depot = samples[i].depot;
+  printf ("Magazine depots: %lu gets (%.1f%% hit), %lu puts (%.1f%% hit), "
+          "%lu locks held %.0f cycles on average\n",
+          (unsigned long)depot.gets,
+          depot.gets ? 100.0 * (double)depot.get_hits / (double)depot.gets : 0.0,
+          (unsigned long)depot.puts,
+          depot.puts ? 100.0 * (double)depot.put_hits / (double)depot.puts : 0.0,
+          (unsigned long)depot.locks,
+          depot.locks ? (double)depot.hold_cycles / (double)depot.locks : 0.0);
+#if defined(MM_LOCK_STATS)
+  printf ("Lock waits in cycles:\n");
+  printf ("%12s%14s%12s%12s%12s%12s\n", "", "lock", "acquires", "contended",
+          "avg wait", "max wait");
+  for (unsigned i = 0; i < MT_FRONTS; i++)
+  {
+    const mt_sample_t *s = &samples[i];
+    const mm_lock_stats_t *locks[6] = {
+      &s->front_locks.heap, &s->front_locks.cpus, &s->front_locks.depots,
+      &s->one_lock, &s->engine.heap_lock, &s->engine.list_locks
+    };
+    const char *names[6] = { "heap", "per-CPU", "depots", "one lock",
+                             "engine heap", "engine lists" };
+    for (int j = 0; j < 6; j++)
+      if (locks[j]->acquires != 0)
+        printf ("%12s%14s%12lu%12lu%12.0f%12lu\n", mt_fronts[i].name,
+                names[j], (unsigned long)locks[j]->acquires,
+                (unsigned long)locks[j]->contended,
+                locks[j]->contended ? (double)locks[j]->wait_cycles /
+                                          (double)locks[j]->contended
+                                    : 0.0,
+                (unsigned long)locks[j]->max_wait_cycles);
+  }
+#endif
+}
+
+#if defined(MM_HANDLES)
+/*
+ * The handle mode replays each trace through mm_halloc and mm_hfree, a
+ * realloc being a new handle the old payload is copied into. Payloads are
+ * filled with the low byte of their index and checked when freed, so a
+ * block the compactor moved wrongly is caught. Just before the run of frees
+ * that ends each trace, the heap is compacted by mm_compact (HANDLE_STEP)
+ * calls until a pass finishes. With interleave set, mm_compact (HANDLE_STEP)
+ * is also called after every op, and every HANDLE_PIN_EVERY-th live block is
+ * locked across that final pass and must not move. Locked blocks high in the
+ * heap keep it from being trimmed, so the pass measured runs without them.
+ */
+#define HANDLE_STEP (64 * 1024)
+#define HANDLE_PIN_EVERY 16
+
+/*
+ * handle_fill, handle_check - write and check the pattern of block index
+ */
+static void
+handle_fill (mm_handle_t h, unsigned index, uint32_t from, uint32_t size)
+{
+  unsigned char *p = mm_hlock (h);
+  memset (p + from, index & 0xFF, size - from);
+  mm_hunlock (h);
+}
+
+static int
+handle_check (mm_handle_t h, unsigned index, uint32_t size)
+{
+  unsigned char *p = mm_hlock (h);
+  uint32_t j = 0;
+  while (j < size && p[j] == (index & 0xFF))
+    j++;
+  mm_hunlock (h);
+  return j == size;
+}
+
+static int
+eval_mm_handles (trace_t *trace, unsigned tracenum, int interleave,
+                 handle_stats_t *hstats)
+{
+  mm_handle_t *handles;
+  mm_handle_t h;
+  unsigned index, last, pinned;
+  uint32_t size, oldsize;
+  void **pins;
+
+  mem_reset_brk ();
+  if (mm_init () < 0)
+  {
+    malloc_error (tracenum, 0, "mm_init failed.");
+    return 0;
+  }
+  handles = (mm_handle_t *)calloc (trace->num_ids, sizeof (mm_handle_t));
+  pins = (void **)calloc (trace->num_ids, sizeof (void *));
+  if (handles == NULL || pins == NULL)
+    unix_error ("handles calloc in eval_mm_handles failed");
+
+  /* The trace's closing run of frees starts after its last other op */
+  last = trace->num_ops;
+  while (last > 0 && trace->ops[last - 1].type == FREE)
+    last--;
+
+  for (unsigned i = 0; i < trace->num_ops; i++)
+  {
+    if (i == last)
+    {
+      hstats->live = 0;
+      pinned = 0;
+      for (index = 0; index < trace->num_ids; index++)
+        if (handles[index] != 0)
+        {
+          hstats->live += trace->block_sizes[index];
+          if (interleave && pinned++ % HANDLE_PIN_EVERY == 0)
+            pins[index] = mm_hlock (handles[index]);
+        }
+      hstats->heap = (long double)mem_heapsize ();
+      hstats->steps = 1;
+      while (!mm_compact (HANDLE_STEP))
+        hstats->steps++;
+      hstats->compacted = (long double)mem_heapsize ();
+      for (index = 0; index < trace->num_ids; index++)
+        if (pins[index] != NULL)
+        {
+          if (mm_hlock (handles[index]) != pins[index])
+          {
+            malloc_error (tracenum, i, "mm_compact moved a locked block.");
+            return 0;
+          }
+          mm_hunlock (handles[index]);
+          mm_hunlock (handles[index]);
+          pins[index] = NULL;
+        }
+    }
+
+    index = trace->ops[i].index;
+    size = trace->ops[i].size;
+    switch (trace->ops[i].type)
+    {
+      case ALLOC:
+        if ((h = mm_halloc (size)) == 0)
+        {
+          malloc_error (tracenum, i, "mm_halloc failed.");
+          return 0;
+        }
+        handle_fill (h, index, 0, size);
+        handles[index] = h;
+        trace->block_sizes[index] = size;
+        break;
+
+      case REALLOC:
+        if ((h = mm_halloc (size)) == 0)
+        {
+          malloc_error (tracenum, i, "mm_halloc failed.");
+          return 0;
+        }
+        oldsize = trace->block_sizes[index];
+        if (!handle_check (handles[index], index, oldsize))
+        {
+          malloc_error (tracenum, i, "handle payload was corrupted.");
+          return 0;
+        }
+        memcpy (mm_hlock (h), mm_hlock (handles[index]), oldsize < size ? oldsize : size);
+        mm_hunlock (handles[index]);
+        mm_hunlock (h);
+        if (size > oldsize)
+          handle_fill (h, index, oldsize, size);
+        mm_hfree (handles[index]);
+        handles[index] = h;
+        trace->block_sizes[index] = size;
+        break;
+
+      case FREE:
+        if (!handle_check (handles[index], index, trace->block_sizes[index]))
+        {
+          malloc_error (tracenum, i, "handle payload was corrupted.");
+          return 0;
+        }
+        mm_hfree (handles[index]);
+        handles[index] = 0;
+        break;
+
+      default:
+        app_error ("Nonexistent request type in eval_mm_handles");
+    }
+    if (interleave)
+      mm_compact (HANDLE_STEP);
+    if (interleave && i + 1 == last)
+      hstats->incremental = (long double)mem_heapsize ();
+  }
+  free (handles);
+  free (pins);
+  return 1;
+}
+
+/*
+ * handle_traces - runs the handle mode on every trace and prints the heap
+ *     sizes it saw
+ */
+static void
+handle_traces (char **tracefiles, unsigned n)
+{
+  handle_stats_t *hstats;
+  handle_stats_t incremental = { 0 };
+  trace_t *trace;
+
+  hstats = (handle_stats_t *)calloc (n, sizeof (handle_stats_t));
+  if (hstats == NULL)
+    unix_error ("hstats calloc in handle_traces failed");
+  mem_init ();
+  for (unsigned i = 0; i < n; i++)
+  {
+    trace = read_trace (tracedir, tracefiles[i]);
+    hstats[i].valid = eval_mm_handles (trace, i, 0, &hstats[i]) &&
+                      eval_mm_handles (trace, i, 1, &incremental);
+    hstats[i].incremental = incremental.incremental;
+    free_trace (trace);
+  }
+
+  printf ("\nHandle results for mm malloc:\n");
+  printf ("%5s%7s%10s%10s%14s%7s%16s\n", "trace", " valid", "live KB",
+          "heap KB", "compacted KB", "steps", "incremental KB");
+  for (unsigned i = 0; i < n; i++)
+  {
+    if (hstats[i].valid)
+      printf ("%2u%10s%10.0Lf%10.0Lf%14.0Lf%7u%16.0Lf\n", i, "yes",
+              hstats[i].live / 1024, hstats[i].heap / 1024,
+              hstats[i].compacted / 1024, hstats[i].steps,
+              hstats[i].incremental / 1024);
+    else
+      printf ("%2u%10s\n", i, "no");
+  }
+  free (hstats);
+}
+#endif
+
+/*
+ * huge_traces - times every trace whose heap reaches a huge page, first on
+ *     ordinary pages and then on huge pages, and prints the throughput of
+ *     each
+ */
+static void
+huge_traces (char **tracefiles, unsigned n)
+{
+  huge_stats_t *hstats;
+  range_t *ranges = NULL;
+  speed_t speed_params;
+  trace_t *trace;
+  stats_t *stats;
+  int backing = 0;
+
+  hstats = (huge_stats_t *)calloc (n, sizeof (huge_stats_t));
+  stats = (stats_t *)calloc (1, sizeof (stats_t));
+  if (hstats == NULL || stats == NULL)
+    unix_error ("hstats calloc in huge_traces failed");
+  for (int huge = 0; huge <= 1; huge++)
+  {
+    mem_set_huge_pages (huge);
+    mem_init ();
+    if (huge)
+      backing = mem_huge_pages ();
+    for (unsigned i = 0; i < n; i++)
+    {
+      /* Smaller heaps can't use a huge page */
+      if (huge && (!hstats[i].valid || hstats[i].peak < mem_hugepagesize ()))
+        continue;
+      trace = read_trace (tracedir, tracefiles[i]);
+      hstats[i].valid = eval_mm_valid (trace, i, &ranges);
+      if (hstats[i].valid)
+      {
+        eval_mm_util (trace, stats);
+        if (!huge)
+          hstats[i].peak = (long double)mem_peak_heapsize ();
+        hstats[i].ops = trace->num_ops;
+        speed_params.trace = trace;
+        speed_params.ranges = ranges;
+        hstats[i].secs[huge] = fsecs (eval_mm_speed, &speed_params);
+        if (huge)
+          hstats[i].thp = (long double)anon_huge_kb () * 1024;
+      }
+      free_trace (trace);
+    }
+    mem_deinit ();
+  }
+  clear_ranges (&ranges);
+
+  printf ("\nHuge page results for mm malloc, %s:\n",
+          backing == MEM_HUGE_TLB   ? "on hugetlb pages"
+          : backing == MEM_HUGE_THP ? "on transparent huge pages"
+                                    : "no huge pages were available");
+  printf ("%5s%7s%10s%12s%12s%8s%9s\n", "trace", " valid", "peak KB",
+          "Kops", "huge Kops", "gain", "THP KB");
+  unsigned shown = 0;
+  for (unsigned i = 0; i < n; i++)
+  {
+    if (!hstats[i].valid)
+    {
+      printf ("%2u%10s\n", i, "no");
+      continue;
+    }
+    if (hstats[i].peak < mem_hugepagesize ())
+      continue;
+    long double ops = hstats[i].ops;
+    printf ("%2u%10s%10.0Lf%12.2Lf%12.2Lf%7.1Lf%%%9.0Lf\n", i, "yes",
+            hstats[i].peak / 1024, ops / 1e3 / hstats[i].secs[0],
+            ops / 1e3 / hstats[i].secs[1],
+            (hstats[i].secs[0] / hstats[i].secs[1] - 1) * 100,
+            hstats[i].thp / 1024);
+    shown++;
+  }
+  if (shown == 0)
+    printf ("No trace's heap reached a huge page\n");
+  free (stats);
+  free (hstats);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -857,38 +1976,50 @@ eval_mm_speed (void *ptr)
  *
  */
 static int
-eval_libc_valid (trace_t *trace, unsigned tracenum)
+eval_libc_valid (trace_t *trace, unsigned tracenum, stats_t *stats)
 {
   unsigned int i, newsize;
   unsigned char *p, *newp, *oldp;
+  struct timespec start;
 
+  touched_pages = touched_allocs = 0;
   for (i = 0; i < trace->num_ops; i++)
   {
     switch (trace->ops[i].type)
     {
 
       case ALLOC: /* malloc */
-        if ((p = malloc (trace->ops[i].size)) == NULL)
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        p = malloc (trace->ops[i].size);
+        op_secs (&start, stats);
+        if (p == NULL)
         {
           malloc_error (tracenum, i, "libc malloc failed");
           unix_error ("System message");
         }
+        count_pages (p, trace->ops[i].size);
         trace->blocks[trace->ops[i].index] = p;
         break;
 
       case REALLOC: /* realloc */
         newsize = trace->ops[i].size;
         oldp = trace->blocks[trace->ops[i].index];
-        if ((newp = realloc (oldp, newsize)) == NULL)
+        clock_gettime (CLOCK_MONOTONIC, &start);
+        newp = realloc (oldp, newsize);
+        op_secs (&start, stats);
+        if (newp == NULL)
         {
           malloc_error (tracenum, i, "libc realloc failed");
           unix_error ("System message");
         }
+        count_pages (newp, newsize);
         trace->blocks[trace->ops[i].index] = newp;
         break;
 
       case FREE: /* free */
+        clock_gettime (CLOCK_MONOTONIC, &start);
         free (trace->blocks[trace->ops[i].index]);
+        op_secs (&start, stats);
         break;
 
       default:
@@ -952,37 +2083,188 @@ printresults (unsigned n, stats_t *stats)
   long double secs = 0;
   long double ops = 0;
   long double util = 0;
+  long double pages = 0;
 
   /* Print the individual results for each trace */
-  printf ("%5s%7s %7s%8s%10s%12s\n", "trace", " valid", "util", "ops", "secs",
-          "Kops");
+  long double max_op = 0;
+  unsigned long hist[OP_HIST_BUCKETS] = { 0 };
+
+  long double faults = 0;
+  long double resident = 0;
+  long double committed = 0;
+
+  printf ("%5s%7s %7s%8s%10s%12s%8s%8s%9s%9s%9s%9s\n", "trace", " valid", "util", "ops", "secs",
+          "Kops", "pages", "faults", "res KB", "com KB", "p99 us", "max us");
   for (unsigned i = 0; i < n; i++)
   {
     if (stats[i].valid)
     {
-      printf ("%2u%10s%7.2Lf%%%8.0Lf%10.6Lf%12.2Lf\n", i, "yes",
+      printf ("%2u%10s%7.2Lf%%%8.0Lf%10.6Lf%12.2Lf%8.2Lf%8.0Lf%9.0Lf%9.0Lf%9.2Lf%9.2Lf\n", i, "yes",
               stats[i].util * 100.0, stats[i].ops, stats[i].secs,
-              (stats[i].ops / 1e3) / stats[i].secs);
+              (stats[i].ops / 1e3) / stats[i].secs, stats[i].pages,
+              stats[i].faults, stats[i].resident / 1024, stats[i].committed / 1024,
+              hist_percentile (stats[i].op_hist, 99) * 1e6, stats[i].max_op_secs * 1e6);
       secs += stats[i].secs;
       ops += stats[i].ops;
       util += stats[i].util;
+      pages += stats[i].pages;
+      faults += stats[i].faults;
+      resident += stats[i].resident;
+      /* Storage is committed up to a trace's peak, so the most any one
+         trace committed is what the set needs */
+      if (stats[i].committed > committed)
+        committed = stats[i].committed;
+      if (stats[i].max_op_secs > max_op)
+        max_op = stats[i].max_op_secs;
+      for (unsigned b = 0; b < OP_HIST_BUCKETS; b++)
+        hist[b] += stats[i].op_hist[b];
     }
     else
     {
-      printf ("%2d%10s%8s%8s%10s%12s\n", i, "no", "-", "-", "-", "-");
+      printf ("%2d%10s%8s%8s%10s%12s%8s%8s%9s%9s%9s%9s\n", i, "no", "-", "-", "-", "-", "-",
+              "-", "-", "-", "-", "-");
     }
   }
 
   /* Print the aggregate results for the set of traces */
   if (errors == 0)
   {
-    printf ("%12s%7.2Lf%%%8.0Lf%10.6Lf%12.2Lf\n", "Total       ", (util / n) * 100.0,
-            ops, secs, (ops / 1e3) / secs);
+    printf ("%12s%7.2Lf%%%8.0Lf%10.6Lf%12.2Lf%8.2Lf%8.0Lf%9.0Lf%9.0Lf%9.2Lf%9.2Lf\n", "Total       ", (util / n) * 100.0,
+            ops, secs, (ops / 1e3) / secs, pages / n, faults, resident / 1024,
+            committed / 1024, hist_percentile (hist, 99) * 1e6, max_op * 1e6);
   }
   else
   {
-    printf ("%12s%8s%8s%10s%12s\n", "Total       ", "-", "-", "-", "-");
+    printf ("%12s%8s%8s%10s%12s%8s%8s%9s%9s%9s%9s\n", "Total       ", "-", "-", "-", "-", "-",
+            "-", "-", "-", "-", "-");
+  }
+}
+
+/*
+ * printcounters - prints the counters mm collected during the last timed
+ *     run of each trace, along with the time the util pass spent in realloc
+ */
+static void
+printcounters (unsigned n, stats_t *stats, mm_stats_t *counters)
+{
+  printf ("%5s%12s%14s%13s%13s%13s%9s%13s\n", "trace", "fit calls",
+          "cycles/call", "copied KB", "remapped KB", "realloc ms", "map KB",
+          "cyc/lookup");
+  for (unsigned i = 0; i < n; i++)
+  {
+    long double per_call = 0;
+    long double per_lookup = 0;
+    if (counters[i].fit_calls != 0)
+      per_call = (long double)counters[i].fit_cycles / counters[i].fit_calls;
+    if (counters[i].map_lookups != 0)
+      per_lookup = (long double)counters[i].map_cycles / counters[i].map_lookups;
+    printf ("%2u%15llu%14.1Lf%13.1Lf%13.1Lf%13.3Lf%9.1Lf%13.1Lf\n", i,
+            (unsigned long long)counters[i].fit_calls, per_call,
+            (long double)counters[i].realloc_copied / 1024,
+            (long double)counters[i].realloc_remapped / 1024,
+            stats[i].realloc_secs * 1e3,
+            (long double)counters[i].map_bytes / 1024, per_lookup);
+  }
+}
+
+/*
+ * op_secs - Seconds since start, which is when a single allocator call
+ *     began. Also keeps the slowest call seen in stats.
+ */
+static long double
+op_secs (struct timespec *start, stats_t *stats)
+{
+  struct timespec end;
+  long double secs;
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  secs = (long double)(end.tv_sec - start->tv_sec) +
+         (long double)(end.tv_nsec - start->tv_nsec) / 1e9;
+  if (secs > stats->max_op_secs)
+    stats->max_op_secs = secs;
+  unsigned long bucket = (unsigned long)(secs * 1e9 / OP_HIST_NS);
+  stats->op_hist[bucket < OP_HIST_BUCKETS ? bucket : OP_HIST_BUCKETS - 1]++;
+  return secs;
+}
+
+/*
+ * hist_percentile - Seconds within which pct percent of the calls counted
+ *     in hist finished, to the bucket
+ */
+static long double
+hist_percentile (unsigned long *hist, long double pct)
+{
+  unsigned long total = 0;
+  unsigned long seen = 0;
+  unsigned i;
+
+  for (i = 0; i < OP_HIST_BUCKETS; i++)
+    total += hist[i];
+  for (i = 0; i < OP_HIST_BUCKETS - 1; i++)
+  {
+    seen += hist[i];
+    if (seen >= total * pct / 100)
+      break;
   }
+  return (long double)(i + 1) * OP_HIST_NS / 1e9;
+}
+
+/*
+ * minor_faults - Minor page faults this thread has taken so far, leaving
+ *     out the ones helper threads took on its behalf
+ */
+static long
+minor_faults (void)
+{
+  struct rusage usage;
+
+  if (getrusage (RUSAGE_THREAD, &usage) != 0)
+    return 0;
+  return usage.ru_minflt;
+}
+
+/*
+ * anon_huge_kb - KB of transparent huge pages the process has mapped, or
+ *     -1 when the kernel doesn't say
+ */
+static long
+anon_huge_kb (void)
+{
+  FILE *f = fopen ("/proc/self/smaps_rollup", "r");
+  char line[128];
+  long kb = -1;
+
+  if (f == NULL)
+    return -1;
+  while (fgets (line, sizeof (line), f) != NULL)
+    if (sscanf (line, "AnonHugePages: %ld kB", &kb) == 1)
+      break;
+  fclose (f);
+  return kb;
+}
+
+/*
+ * count_pages - Record how many pages the payload [lo, lo+size) spans
+ */
+static void
+count_pages (unsigned char *lo, uint32_t size)
+{
+  unsigned long long pagesize = mem_pagesize ();
+  unsigned long long first = (unsigned long long)lo / pagesize;
+  unsigned long long last = ((unsigned long long)lo + size - 1) / pagesize;
+  touched_pages += last - first + 1;
+  touched_allocs++;
+}
+
+/*
+ * pages_per_alloc - Average pages spanned per payload since the last reset
+ */
+static long double
+pages_per_alloc (void)
+{
+  if (touched_allocs == 0)
+    return 0;
+  return (long double)touched_pages / (long double)touched_allocs;
 }
 
 /*
@@ -1021,13 +2303,27 @@ malloc_error (unsigned tracenum, unsigned opnum, char *msg)
 static void
 usage (void)
 {
-  fprintf (stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+  fprintf (stderr, "Usage: mdriver [-hHvVals] [-f <file>] [-t <dir>] [-p <size>] [-c <size>] [-A <size>] [-m <n>] [-M <MB>] [-b <us>[,<KB>]] [-w <KB>] [-r] [-u] [-U]\n");
   fprintf (stderr, "Options\n");
+  fprintf (stderr, "\t-A <size>  Check mm_arena, then compare it with mm_malloc on <size> byte objects.\n");
+  fprintf (stderr, "\t-b <us>[,<KB>]  Wake the maintenance thread every <us> (0 for never) and purge\n"
+                  "\t           free blocks of <KB> and up, 64 unless given, 0 for none (build with -DMM_BACKGROUND).\n");
+  fprintf (stderr, "\t-c <size>  Like -p, for objects that need constructing.\n");
   fprintf (stderr, "\t-f <file>  Use <file> as the trace file.\n");
   fprintf (stderr, "\t-g         Generate summary info for autograder.\n");
   fprintf (stderr, "\t-h         Print this message.\n");
+  fprintf (stderr, "\t-H         Replay the traces through handles and compact (build with -DMM_HANDLES).\n");
   fprintf (stderr, "\t-l         Run libc malloc as well.\n");
+  fprintf (stderr, "\t-m <n>     Compare per-CPU caches, per-thread caches and magazines with <n> threads.\n");
+  fprintf (stderr, "\t-M <MB>    Reserve <MB> of address space for the heap instead of MAX_HEAP.\n");
+  fprintf (stderr, "\t-p <size>  Compare mm_pool and mm_malloc on <size> byte objects.\n");
+  fprintf (stderr, "\t-r         Lock the whole heap in memory before the traces run.\n");
+  fprintf (stderr, "\t-s         Print mm's own counters (build with -DMM_STATS).\n");
   fprintf (stderr, "\t-t <dir>   Directory to find default traces.\n");
+  fprintf (stderr, "\t-u         Back the heap with huge pages.\n");
+  fprintf (stderr, "\t-U         Compare throughput with and without huge pages on the traces whose heap\n"
+                  "\t           reaches a huge page.\n");
   fprintf (stderr, "\t-v         Print per-trace performance breakdowns.\n");
   fprintf (stderr, "\t-V         Print additional debug info.\n");
+  fprintf (stderr, "\t-w <KB>    Keep the <KB> past the brk faulted in from a helper thread.\n");
 }
@@ -7,8 +7,12 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,9 +22,260 @@
 #include "config.h"
 #include "memlib.h"
 
+/* mem_brk and mem_peak_brk may be moved by an allocator's maintenance
+   thread while the driver reads or resets them, so they are only
+   touched atomically */
 static char *mem_start_brk; /* points to first byte of heap */
 static char *mem_brk;       /* points to last byte of heap */
 static char *mem_max_addr;  /* largest legal heap address */
+static char *mem_peak_brk;  /* highest the brk has been since the last reset */
+static int mem_locked;      /* whether mem_lock committed the storage */
+
+/* mem_init only reserves mem_max_heap bytes of address space, mapped with
+   no access and no swap reserved, so a large maximum costs nothing up
+   front. Storage is committed, made readable and writable, COMMIT_CHUNK
+   bytes at a time as the brk or the prefault helper gets to it, and stays
+   committed until mem_release. */
+#define COMMIT_CHUNK (1 << 20)
+static size_t mem_max_heap = MAX_HEAP;
+static char *mem_commit_brk; /* end of the committed storage */
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Asked for with mem_set_huge_pages, mem_init backs the heap with huge
+   pages: from the hugetlb pool if it has enough set aside, and otherwise
+   with transparent huge pages in a HUGE_PAGE aligned reservation. Storage
+   is then committed and decommitted a huge page at a time, so every huge
+   page of it is either wholly usable or not at all. */
+#define HUGE_PAGE (2 << 20)
+static int mem_want_huge;     /* whether the next mem_init tries */
+static int mem_huge;          /* MEM_HUGE_TLB, MEM_HUGE_THP or 0 */
+static int mem_map_flags;     /* what the storage is mapped with */
+static size_t mem_chunk;      /* what it is committed in */
+
+/* A helper thread started by mem_prefault keeps the pages from the brk up
+   to prefault_window bytes past it populated, so the allocator doesn't
+   fault them in itself when it grows the heap. It wakes once the brk has
+   eaten a quarter of the window. */
+static pthread_mutex_t prefault_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefault_wake = PTHREAD_COND_INITIALIZER;
+static pthread_once_t prefault_once = PTHREAD_ONCE_INIT;
+static size_t prefault_window;
+static char *prefault_target; /* end of the pages asked for */
+/* The helper populates PREFAULT_STEP bytes at a time and yields between
+   steps, so it doesn't keep the allocator off a busy CPU for long */
+#define PREFAULT_STEP (256 * 1024)
+static char *prefault_done;   /* end of the pages populated */
+static unsigned prefault_gen; /* bumped whenever populated pages are dropped */
+/* Held by the helper while it populates, so mem_release can't decommit
+   the pages under it */
+static pthread_mutex_t populate_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t
+page_round (size_t n)
+{
+  size_t pagesize = mem_pagesize ();
+  return (n + pagesize - 1) & ~(pagesize - 1);
+}
+
+static size_t
+chunk_round (size_t n)
+{
+  return (n + mem_chunk - 1) & ~(mem_chunk - 1);
+}
+
+/*
+ * map_storage - map len bytes of fresh storage over [at, at+len), the same
+ *    way mem_init mapped the rest
+ */
+static void *
+map_storage (char *at, size_t len, int prot)
+{
+  void *p = mmap (at, len, prot, mem_map_flags | MAP_FIXED, -1, 0);
+#if defined(MADV_HUGEPAGE)
+  if (p != MAP_FAILED && mem_huge == MEM_HUGE_THP)
+    madvise (p, len, MADV_HUGEPAGE);
+#endif
+  return p;
+}
+
+/*
+ * reserve_huge - reserve len bytes, a multiple of HUGE_PAGE, to be backed
+ *    by huge pages. Sets mem_huge to what it got.
+ */
+static char *
+reserve_huge (size_t len)
+{
+  char *p;
+#if defined(MAP_HUGETLB)
+  /* Without MAP_NORESERVE the kernel sets the pool's pages aside now, so
+     a pool too small fails here rather than on a later fault */
+  mem_map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+  p = (char *)mmap (NULL, len, PROT_NONE, mem_map_flags, -1, 0);
+  if (p != MAP_FAILED)
+  {
+    mem_huge = MEM_HUGE_TLB;
+    return p;
+  }
+#endif
+  mem_map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  p = (char *)mmap (NULL, len + HUGE_PAGE, PROT_NONE, mem_map_flags, -1, 0);
+  if (p == MAP_FAILED)
+    return p;
+  /* Keep the HUGE_PAGE aligned part */
+  char *start = (char *)(((size_t)p + HUGE_PAGE - 1) & ~((size_t)HUGE_PAGE - 1));
+  if (start > p)
+    munmap (p, (size_t)(start - p));
+  if (p + HUGE_PAGE > start)
+    munmap (start + len, (size_t)(p + HUGE_PAGE - start));
+#if defined(MADV_HUGEPAGE)
+  if (madvise (start, len, MADV_HUGEPAGE) == 0)
+    mem_huge = MEM_HUGE_THP;
+#endif
+  return start;
+}
+
+/*
+ * commit - make the storage up to end readable and writable. Returns 0 on
+ *    success and -1 if end is past the reservation or the kernel refused.
+ */
+static int
+commit (char *end)
+{
+  if (end <= __atomic_load_n (&mem_commit_brk, __ATOMIC_ACQUIRE))
+    return 0;
+  if (end > mem_max_addr)
+    return -1;
+  pthread_mutex_lock (&commit_lock);
+  char *lo = mem_commit_brk;
+  int ok = 0;
+  if (end > lo)
+  {
+    char *hi = mem_start_brk + chunk_round ((size_t)(end - mem_start_brk));
+    if (hi > mem_max_addr)
+      hi = mem_max_addr;
+    if (mprotect (lo, (size_t)(hi - lo), PROT_READ | PROT_WRITE) == 0)
+      __atomic_store_n (&mem_commit_brk, hi, __ATOMIC_RELEASE);
+    else
+      ok = -1;
+  }
+  pthread_mutex_unlock (&commit_lock);
+  return ok;
+}
+
+/*
+ * populate - fault in the pages of [lo, hi) writable, without changing
+ *    what they hold, since the allocator may be using them by now
+ */
+static void
+populate (char *lo, char *hi)
+{
+#if defined(MADV_POPULATE_WRITE)
+  if (madvise (lo, (size_t)(hi - lo), MADV_POPULATE_WRITE) == 0)
+    return;
+#endif
+  for (char *p = lo; p < hi; p += mem_pagesize ())
+    __atomic_fetch_add (p, 0, __ATOMIC_RELAXED);
+}
+
+static void *
+prefault_thread (void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock (&prefault_lock);
+  for (;;)
+  {
+    while (prefault_done >= prefault_target)
+      pthread_cond_wait (&prefault_wake, &prefault_lock);
+    char *lo = prefault_done;
+    char *hi = prefault_target;
+    if (hi - lo > PREFAULT_STEP)
+      hi = lo + PREFAULT_STEP;
+    unsigned gen = prefault_gen;
+    pthread_mutex_unlock (&prefault_lock);
+    pthread_mutex_lock (&populate_lock);
+    /* The pages may have been decommitted since they were asked for */
+    if (__atomic_load_n (&prefault_gen, __ATOMIC_RELAXED) == gen)
+      populate (lo, hi);
+    pthread_mutex_unlock (&populate_lock);
+    pthread_mutex_lock (&prefault_lock);
+    /* Unless a reset or a shrink dropped pages in the meantime */
+    if (prefault_gen == gen)
+      prefault_done = hi;
+    pthread_mutex_unlock (&prefault_lock);
+    sched_yield ();
+    pthread_mutex_lock (&prefault_lock);
+  }
+  return NULL;
+}
+
+static void
+prefault_start (void)
+{
+  pthread_t thread;
+  if (pthread_create (&thread, NULL, prefault_thread, NULL) == 0)
+    pthread_detach (thread);
+}
+
+/*
+ * prefault_ahead - ask the helper for the window past brk, once the brk
+ *    is within three quarters of a window of what was asked for last
+ */
+static void
+prefault_ahead (char *brk)
+{
+  size_t window = __atomic_load_n (&prefault_window, __ATOMIC_RELAXED);
+  if (window == 0)
+    return;
+  pthread_mutex_lock (&prefault_lock);
+  char *target = mem_start_brk + page_round ((size_t)(brk - mem_start_brk) + window);
+  if (target > mem_max_addr)
+    target = mem_max_addr;
+  /* The helper may only touch committed storage */
+  if (commit (target) != 0)
+    target = __atomic_load_n (&mem_commit_brk, __ATOMIC_ACQUIRE);
+  if (target > prefault_target && (size_t)(target - prefault_target) >= window / 4)
+  {
+    prefault_target = target;
+    pthread_cond_signal (&prefault_wake);
+  }
+  pthread_mutex_unlock (&prefault_lock);
+}
+
+/*
+ * prefault_forget - the pages from lo up were handed back, so the helper
+ *    has to populate them again
+ */
+static void
+prefault_forget (char *lo)
+{
+  pthread_mutex_lock (&prefault_lock);
+  if (prefault_done > lo)
+    prefault_done = lo;
+  if (prefault_target > lo)
+    prefault_target = lo;
+  __atomic_store_n (&prefault_gen, prefault_gen + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&prefault_lock);
+}
+
+/*
+ * mem_set_max_heap - set how many bytes the next mem_init reserves for the
+ *    heap, rounded up to whole pages; 0 restores the default of MAX_HEAP
+ */
+void
+mem_set_max_heap (size_t bytes)
+{
+  mem_max_heap = bytes == 0 ? MAX_HEAP : page_round (bytes);
+}
+
+/*
+ * mem_set_huge_pages - set whether the next mem_init backs the heap with
+ *    huge pages
+ */
+void
+mem_set_huge_pages (int on)
+{
+  mem_want_huge = on;
+}
 
 /*
  * mem_init - initialize the memory system model
@@ -28,15 +283,39 @@ static char *mem_max_addr;  /* largest legal heap address */
 void
 mem_init (void)
 {
-  /* allocate the storage we will use to model the available VM */
-  if ((mem_start_brk = (char *)malloc (MAX_HEAP)) == NULL)
+  size_t len = mem_max_heap;
+
+  /* reserve the address space we will use to model the available VM. It
+   * comes from mmap rather than malloc so mem_remap can move its pages
+   * around, and commit hands it out as the heap grows. */
+  mem_huge = 0;
+  mem_chunk = COMMIT_CHUNK;
+  if (mem_want_huge)
   {
-    fprintf (stderr, "mem_init_vm: malloc error\n");
+    len = (len + HUGE_PAGE - 1) & ~((size_t)HUGE_PAGE - 1);
+    mem_start_brk = reserve_huge (len);
+    mem_chunk = HUGE_PAGE;
+  }
+  else
+  {
+    mem_map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    mem_start_brk = (char *)mmap (NULL, len, PROT_NONE, mem_map_flags, -1, 0);
+  }
+  if (mem_start_brk == MAP_FAILED)
+  {
+    fprintf (stderr, "mem_init_vm: mmap error\n");
     exit (1);
   }
 
-  mem_max_addr = mem_start_brk + MAX_HEAP; /* max legal heap address */
-  mem_brk = mem_start_brk;                 /* heap is empty initially */
+  mem_max_addr = mem_start_brk + len;      /* max legal heap address */
+  mem_brk = mem_start_brk;                     /* heap is empty initially */
+  mem_peak_brk = mem_start_brk;
+  mem_commit_brk = mem_start_brk;
+  mem_locked = 0;
+  pthread_mutex_lock (&prefault_lock);
+  prefault_done = prefault_target = mem_start_brk;
+  __atomic_store_n (&prefault_gen, prefault_gen + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&prefault_lock);
 }
 
 /*
@@ -45,7 +324,35 @@ mem_init (void)
 void
 mem_deinit (void)
 {
-  free (mem_start_brk);
+  munmap (mem_start_brk, (size_t)(mem_max_addr - mem_start_brk));
+}
+
+/*
+ * mem_prefault - keep the window bytes past the brk populated from now on,
+ *    with a helper thread; a window of 0 stops it
+ */
+void
+mem_prefault (size_t window)
+{
+  pthread_once (&prefault_once, prefault_start);
+  __atomic_store_n (&prefault_window, window, __ATOMIC_RELAXED);
+  prefault_ahead (__atomic_load_n (&mem_brk, __ATOMIC_RELAXED));
+}
+
+/*
+ * mem_lock - the "real-time" mode: lock all of the heap's storage into
+ *    memory, which faults every page in now rather than when the
+ *    allocator first touches it. The pages then stay in even when the
+ *    heap shrinks or is reset. Returns 0 on success and -1 otherwise.
+ */
+int
+mem_lock (void)
+{
+  if (commit (mem_max_addr) != 0 ||
+      mlock (mem_start_brk, (size_t)(mem_max_addr - mem_start_brk)) != 0)
+    return -1;
+  mem_locked = 1;
+  return 0;
 }
 
 /*
@@ -54,29 +361,200 @@ mem_deinit (void)
 void
 mem_reset_brk ()
 {
-  mem_brk = mem_start_brk;
+  __atomic_store_n (&mem_brk, mem_start_brk, __ATOMIC_RELAXED);
+  __atomic_store_n (&mem_peak_brk, mem_start_brk, __ATOMIC_RELAXED);
+  prefault_ahead (mem_start_brk);
+}
+
+/*
+ * mem_release - hand every page of the storage back to the kernel, so
+ *    the next heap faults its pages in afresh, as a new process would.
+ *    The storage past the brk is decommitted as well. Pages locked by
+ *    mem_lock stay.
+ */
+void
+mem_release (void)
+{
+  if (mem_locked)
+    return;
+  char *brk = __atomic_load_n (&mem_brk, __ATOMIC_RELAXED);
+  char *keep = mem_start_brk + chunk_round ((size_t)(brk - mem_start_brk));
+  pthread_mutex_lock (&populate_lock);
+  pthread_mutex_lock (&commit_lock);
+  madvise (mem_start_brk, (size_t)(keep - mem_start_brk), MADV_DONTNEED);
+  if (mem_commit_brk > keep)
+  {
+    if (map_storage (keep, (size_t)(mem_commit_brk - keep), PROT_NONE) == MAP_FAILED)
+    {
+      fprintf (stderr, "ERROR: mem_release could not decommit the heap\n");
+      exit (1);
+    }
+    __atomic_store_n (&mem_commit_brk, keep, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock (&commit_lock);
+  prefault_forget (mem_start_brk);
+  pthread_mutex_unlock (&populate_lock);
+  prefault_ahead (brk);
 }
 
 /*
  * mem_sbrk - simple model of the sbrk function. Extends the heap
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap, and the whole pages it gives up
+ *    are handed back to the kernel.
  */
 void *
 mem_sbrk (int incr)
 {
-  char *old_brk = mem_brk;
+  char *old_brk = __atomic_load_n (&mem_brk, __ATOMIC_RELAXED);
+  char *new_brk;
 
-  if ((incr < 0) || ((mem_brk + incr) > mem_max_addr))
+  do
   {
-    errno = ENOMEM;
-    fprintf (stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-    return (void *)-1;
+    new_brk = old_brk + incr;
+    if ((new_brk < mem_start_brk) || (new_brk > mem_max_addr) ||
+        commit (new_brk) != 0)
+    {
+      errno = ENOMEM;
+      fprintf (stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+      return (void *)-1;
+    }
+  } while (!__atomic_compare_exchange_n (&mem_brk, &old_brk, new_brk, 1,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  char *peak = __atomic_load_n (&mem_peak_brk, __ATOMIC_RELAXED);
+  while (new_brk > peak &&
+         !__atomic_compare_exchange_n (&mem_peak_brk, &peak, new_brk, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  if (incr < 0 && !mem_locked)
+  {
+    char *lo = mem_start_brk + page_round ((size_t)(new_brk - mem_start_brk));
+    if (lo < old_brk)
+    {
+      madvise (lo, (size_t)(old_brk - lo), MADV_DONTNEED);
+      prefault_forget (lo);
+    }
   }
-  mem_brk += incr;
+  else if (incr > 0)
+    prefault_ahead (new_brk);
   return (void *)old_brk;
 }
 
+/*
+ * mem_remap - move the len bytes of pages at src to dst without copying
+ *    them, by moving their page table entries with mremap. Whatever was
+ *    mapped at dst is dropped, and src is refilled with zero pages so
+ *    the heap stays one contiguous mapping. Both ranges must be page
+ *    aligned, inside the heap, and must not overlap. Returns 0 on
+ *    success and -1 if the pages could not be moved.
+ */
+int
+mem_remap (void *dst, void *src, size_t len)
+{
+  size_t pagesize = mem_pagesize ();
+  char *d = (char *)dst;
+  char *s = (char *)src;
+
+  if (((size_t)d | (size_t)s | len) & (pagesize - 1))
+    return -1;
+  char *brk = __atomic_load_n (&mem_brk, __ATOMIC_RELAXED);
+  if (d < mem_start_brk || d + len > brk || s < mem_start_brk ||
+      s + len > brk || (d < s + len && s < d + len))
+    return -1;
+  if (mremap (s, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, d) == MAP_FAILED)
+    return -1;
+  if (map_storage (s, len, PROT_READ | PROT_WRITE) == MAP_FAILED)
+  {
+    fprintf (stderr, "ERROR: mem_remap could not refill the source pages\n");
+    exit (1);
+  }
+  if (mem_locked)
+    mlock (s, len);
+  return 0;
+}
+
+/*
+ * mem_purge - hand the pages of [lo, lo+len) back to the kernel but keep
+ *    them mapped, so they read as zero the next time they are touched.
+ *    The range must be page aligned and inside the storage the heap
+ *    lives in. Returns 0 on success and -1 if the pages were kept.
+ */
+int
+mem_purge (void *lo, size_t len)
+{
+  char *p = (char *)lo;
+
+  if (((size_t)p | len) & (mem_pagesize () - 1))
+    return -1;
+  if (p < mem_start_brk || p + len > mem_max_addr || mem_locked)
+    return -1;
+  return madvise (p, len, MADV_DONTNEED);
+}
+
+/*
+ * mem_resident - return how many bytes of the heap are in memory, by
+ *    asking the kernel about each of its pages
+ */
+size_t
+mem_resident (void)
+{
+  size_t pagesize = mem_pagesize ();
+  size_t len = page_round (mem_heapsize ());
+  size_t resident = 0;
+  unsigned char *vec;
+
+  if (len == 0)
+    return 0;
+  vec = malloc (len / pagesize);
+  if (vec == NULL || mincore (mem_start_brk, len, vec) != 0)
+  {
+    free (vec);
+    return 0;
+  }
+  for (size_t i = 0; i < len / pagesize; i++)
+    resident += vec[i] & 1;
+  free (vec);
+  return resident * pagesize;
+}
+
+/*
+ * mem_committed - return how many bytes of storage are committed
+ */
+size_t
+mem_committed (void)
+{
+  return (size_t)(__atomic_load_n (&mem_commit_brk, __ATOMIC_ACQUIRE) - mem_start_brk);
+}
+
+/*
+ * mem_reserved - return how many bytes of address space the heap may grow
+ *    into
+ */
+size_t
+mem_reserved (void)
+{
+  return (size_t)(mem_max_addr - mem_start_brk);
+}
+
+/*
+ * mem_huge_pages - return what backs the heap: MEM_HUGE_TLB, MEM_HUGE_THP,
+ *    or 0 for ordinary pages
+ */
+int
+mem_huge_pages (void)
+{
+  return mem_huge;
+}
+
+/*
+ * mem_hugepagesize - return the size of the huge pages mem_init asks for
+ */
+size_t
+mem_hugepagesize (void)
+{
+  return HUGE_PAGE;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,7 +570,7 @@ mem_heap_lo ()
 void *
 mem_heap_hi ()
 {
-  return (void *)(mem_brk - 1);
+  return (void *)(__atomic_load_n (&mem_brk, __ATOMIC_RELAXED) - 1);
 }
 
 /*
@@ -101,7 +579,17 @@ mem_heap_hi ()
 size_t
 mem_heapsize ()
 {
-  return (size_t) (mem_brk - mem_start_brk);
+  return (size_t) (__atomic_load_n (&mem_brk, __ATOMIC_RELAXED) - mem_start_brk);
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest the heap has been, in bytes,
+ *    since the last mem_reset_brk
+ */
+size_t
+mem_peak_heapsize ()
+{
+  return (size_t) (__atomic_load_n (&mem_peak_brk, __ATOMIC_RELAXED) - mem_start_brk);
 }
 
 /*
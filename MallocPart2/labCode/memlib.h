@@ -1,11 +1,28 @@
 #include <unistd.h>
 
+/* What mem_huge_pages says backs the heap */
+#define MEM_HUGE_THP 1 /* transparent huge pages */
+#define MEM_HUGE_TLB 2 /* the hugetlb pool */
+
+void mem_set_max_heap(size_t bytes);
+void mem_set_huge_pages(int on);
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+void mem_release(void);
+void mem_prefault(size_t window);
+int mem_lock(void);
+int mem_remap(void *dst, void *src, size_t len);
+int mem_purge(void *lo, size_t len);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+size_t mem_resident(void);
+size_t mem_committed(void);
+size_t mem_reserved(void);
 size_t mem_pagesize(void);
+int mem_huge_pages(void);
+size_t mem_hugepagesize(void);
 
@@ -1,37 +1,298 @@
 // Brought to you by Joe Dunton and James Leo Roche IV 
 
+#if defined(MM_BACKGROUND)
+// For the recursive mutex initializer
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#if defined(MM_BACKGROUND)
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#include "config.h"
 #include "memlib.h"
 #include "mm.h"
+#include "mm_class.h"
 
 #define ALIGNMENT 16
 #define WSIZE 8
 #define DSIZE 16
 #define OVERHEAD (2 * sizeof(word))
 #define CHUNKSIZE (1<<24)
+// The heap grows by at least WILD_CHUNK bytes at a time; what a growth
+// doesn't use yet stays past the epilogue as the wilderness
+#define WILD_CHUNK (1<<12)
+// How far past heap_lo blocks may reach, however much address space memlib
+// reserved: the side table and the span map cover MAX_HEAP bytes, and
+// compact links hold 32-bit offsets
+#if defined(MM_SIDE_TABLE) || defined(MM_SMALL_SPANS)
+#define MODE_REACH ((uintptr_t)MAX_HEAP)
+#elif defined(MM_COMPACT_LINKS)
+#define MODE_REACH ((uintptr_t)UINT32_MAX)
+#else
+#define MODE_REACH UINTPTR_MAX
+#endif
+// In every mode a block, and so the heap, stays within what the size bits
+// of a tag can hold, just under 4 GiB
+#define TAG_REACH ((uintptr_t)SIZE_MASK * WSIZE)
+#define HEAP_REACH (MODE_REACH < TAG_REACH ? MODE_REACH : TAG_REACH)
+
+// MM_COMPACT_LINKS stores the free list links as 32-bit offsets from the
+// start of the heap instead of full pointers. Both links then fit in the
+// 8 byte payload of a 2 word block, which halves the minimum block size.
+// MM_FIT_INDEX needs a third slot after the links, so it keeps 4 words.
+#if defined(MM_SIDE_TABLE) || (defined(MM_COMPACT_LINKS) && !defined(MM_FIT_INDEX))
+#define MIN_BLOCK_SIZE 2
+#else
 #define MIN_BLOCK_SIZE 4
+#endif
+
+// MM_SIDE_TABLE moves the free list out of the heap. Each free block gets a
+// descriptor with its links, size and index slot, packed with the others at
+// the front of side_descs, and side_slots maps the DSIZE granule a free
+// block's payload starts in to its descriptor. Freeing a block then writes
+// only its tags, purged pages stay untouched while their block sits on the
+// list, and find_fit walks the descriptors without reading the heap. With no
+// links in the payload, a free block needs just its tags.
+#define SIDE_SLOTS (MAX_HEAP / DSIZE)
+// Free blocks are never next to each other for long, so at most every other
+// 2 word block is free
+#define SIDE_DESCS (MAX_HEAP / (2 * DSIZE) + 2)
+
+// Bytes at the start of a free block's payload taken by its links
+#if defined(MM_SIDE_TABLE)
+#define LINK_BYTES 0
+#else
+#define LINK_BYTES (2 * DSIZE)
+#endif
+
+// The top bit of an allocated block's header marks a block that has already
+// been grown by realloc once. Such blocks get geometric headroom the next time
+// they grow, capped at REALLOC_HEADROOM_CAP words so util doesn't collapse.
+#define GROWN_BIT ((uint32_t)1 << 31)
+// The next bit marks an allocated block owned by a handle, which the
+// compactor may move
+#define HANDLE_BIT ((uint32_t)1 << 30)
+// And the next one a free block whose inner pages have been purged
+#define PURGED_BIT ((uint32_t)1 << 29)
+#define SIZE_MASK (~(GROWN_BIT | HANDLE_BIT | PURGED_BIT | 1))
+#define REALLOC_HEADROOM_CAP (1 << 13)
+
+// MM_PAGE_AWARE shifts medium blocks (payloads of at least PAGE_AWARE_MIN
+// bytes that fit in one page) so they don't straddle a page boundary, as
+// long as the free block has room to leave the skipped bytes as a free block.
+#define PAGE_AWARE_MIN 1024
+
+#define NO_FIT UINT32_MAX
+
+// MM_FIT_INDEX keeps the size of every free block in a contiguous array that
+// find_fit scans with SIMD compares, so only the block that fits is touched.
+// Free blocks past FIT_INDEX_CAP stay on the list only and are found by a
+// list walk once the index has no fit.
+#define FIT_INDEX_CAP (1 << 18)
+
+// Realloc moves payloads of at least REMAP_MIN bytes by remapping their whole
+// pages, and copies ones of at least STREAM_COPY_MIN bytes with non-temporal
+// stores, so a big move doesn't flush the caller's working set from cache.
+#define REMAP_MIN (1 << 18)
+#define STREAM_COPY_MIN (1 << 18)
+
+// MM_SMALL_SPANS serves requests of up to SPAN_OBJ_MAX bytes from spans: page
+// aligned allocated blocks cut into headerless objects of one size class. A
+// two level radix map from each page of the heap to its span lets mm_free
+// find an object's span and class in two loads; pages the map doesn't know
+// hold ordinary tagged blocks. Map leaves are allocated from the heap.
+#define SPAN_OBJ_MAX MM_CLASS_MAX
+#define SPAN_CLASSES MM_CLASSES
+#define SPAN_PAGE_SHIFT 12
+#define SPAN_PAGE (1u << SPAN_PAGE_SHIFT)
+#define SPAN_MAX_PAGES 16
+#define SPAN_WASTE 8
+#define MAP_LEAF_BITS 8
+#define MAP_LEAF_SIZE (1u << MAP_LEAF_BITS)
+#define MAP_ROOT_SIZE ((MAX_HEAP >> (SPAN_PAGE_SHIFT + MAP_LEAF_BITS)) + 1)
+
+// MM_HANDLES adds movable blocks reached through handles. A handle indexes a
+// table entry holding its block's address; the block's first word holds the
+// handle back, and the caller's payload starts DSIZE bytes in. mm_compact
+// slides unpinned handle blocks down into the free blocks right before them,
+// or moves them into a lower free block they fit in when a locked or plain
+// block stops the slide. It does a bounded amount of work per call and trims
+// the heap after each full pass.
+#define HANDLE_MAX (1 << 20)
+// Work charged for stepping over a block the compactor doesn't move
+#define COMPACT_VISIT 64
+
+// MM_PURGE hands the inner whole pages of a free block of at least
+// PURGE_MIN bytes back to the kernel when it is freed, since the brk can't
+// shrink below the blocks after it. Its tags and links stay, and it is
+// marked purged; mm_calloc skips zeroing the pages a purged block still has
+// untouched.
+#define PURGE_MIN (1 << 20)
+
+// MM_BACKGROUND hands the upkeep of the heap to a maintenance thread, and
+// makes every entry point take the heap lock. mm_free just pushes the block,
+// still tagged allocated, on a lock-free stack of deferred frees. The thread
+// wakes every bg_interval microseconds, merges the deferred frees BG_SLICE
+// at a time so the caller is never shut out for long, gives back the whole
+// pages past the heap top beyond BG_TRIM_KEEP bytes, and purges the inner
+// pages of free blocks of at least bg_purge_min bytes. A malloc that finds
+// no fit merges the deferred frees itself before growing the heap.
+#define BG_INTERVAL_US 1000
+#define BG_PURGE_MIN (1 << 16)
+#define BG_SLICE 64
+#define BG_TRIM_KEEP (1 << 16)
 
 typedef uint64_t word;
 typedef uint32_t tag;
 typedef uint8_t byte;
 typedef byte* address;
 
+#if defined(MM_COMPACT_LINKS)
+typedef uint32_t freeLink;
+#else
+typedef address freeLink;
+#endif
+
 
 // We set this up to represent the start of the heap but also
 // as a way to grab the dummy header of our free list
 static address free_list_head;
 
+// First byte of the heap, which compact links are relative to
+static address heap_lo;
+
+// The epilogue is the header of heap_top. Everything from there up to
+// wild_end has been sbrk'd but isn't part of any block yet.
+static address heap_top;
+static address wild_end;
+
+// Cached mem_pagesize()
+static uintptr_t page_size;
+// The size of the huge pages backing the heap, or 0 on ordinary pages. The
+// wilderness then grows and shrinks a whole huge page at a time, so each
+// huge page of the heap stays in one piece.
+static uintptr_t huge_size;
+
+#if defined(MM_FIT_INDEX)
+// Sizes of indexed free blocks, and the blocks themselves, by slot
+static _Alignas(32) uint32_t fit_sizes[FIT_INDEX_CAP];
+static address fit_blocks[FIT_INDEX_CAP];
+static uint32_t fit_count;
+// Free blocks that didn't fit in the index
+static uint32_t fit_overflow;
+#endif
+
+#if defined(MM_SIDE_TABLE)
+// The free list node of a free block
+typedef struct sideDesc {
+	uint32_t block;  // offset of the block's payload from heap_lo
+	uint32_t size;   // its size in words
+	// Its neighbours on the list, as byte offsets into side_descs, which
+	// saves the list walk scaling an index at every step
+	uint32_t next;
+	uint32_t prev;
+#if defined(MM_FIT_INDEX)
+	uint32_t slot;   // its slot in the fit index
+#endif
+} sideDesc;
+
+// Descriptors in use are the first side_count; the list head's is the first
+static sideDesc side_descs[SIDE_DESCS];
+static uint32_t side_count;
+// Offsets of the descriptors by granule
+static uint32_t side_slots[SIDE_SLOTS];
+#endif
+
+#if defined(MM_SMALL_SPANS)
+// The head of a span, in the first bytes of its first page
+typedef struct spanDesc {
+	address free;           // freed objects
+	struct spanDesc* next;  // spans of the class with objects left
+	struct spanDesc* prev;
+	uint32_t objSize;
+	uint16_t pages;
+	uint16_t used;          // objects handed out
+	uint16_t capacity;      // objects carved out so far
+	uint16_t reserved;      // objects the span can hold
+	uint8_t sizeClass;
+	bool full;
+} spanDesc;
+
+// Leaves hold the span of each page, tagged with its class in the low bits
+static uintptr_t* span_map[MAP_ROOT_SIZE];
+static spanDesc* span_queues[SPAN_CLASSES];
+#endif
+
+#if defined(MM_HANDLES)
+typedef struct handleEntry {
+	address bp;         // the handle's block, or NULL when the slot is free
+	uint32_t pins;      // mm_hlock calls not yet undone
+	uint32_t nextFree;  // next free slot while this one is free
+} handleEntry;
+
+static handleEntry handle_table[HANDLE_MAX];
+// Slots past handle_next have never been used; freed ones are chained
+static uint32_t handle_next;
+static uint32_t handle_free;
+// The block the compactor resumes at. Blocks merged around it pull it back
+// to their start, so it is always a block boundary.
+static address compact_cursor;
+// The free block the search for a lower home for lower_for resumes at, when
+// a call ran out of budget in the middle of it; removeNode moves it past a
+// block taken off the list
+static address lower_cursor;
+static address lower_for;
+#endif
+
+#if defined(MM_BACKGROUND)
+// Held by every entry point. It is recursive since realloc calls mm_malloc
+// and mm_free.
+static pthread_mutex_t heap_lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+// Held while the maintenance thread purges a block without the heap lock,
+// so mm_init can't hand out the block's pages before the purge is done
+static pthread_mutex_t purge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t maintainer_once = PTHREAD_ONCE_INIT;
+// Held by the maintenance thread for a whole round, so mm_background_pause
+// can wait out the round in progress
+static pthread_mutex_t round_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool bg_paused;
+// Deferred frees, chained through their first payload word, and the ones
+// taken off the stack but not merged yet
+static address deferred;
+static address merging;
+// The free block the purge resumes at; removeNode moves it past a block
+// taken off the list
+static address purge_cursor;
+static uint32_t bg_interval = BG_INTERVAL_US;
+static uint32_t bg_purge_min = BG_PURGE_MIN;
+#endif
+
+#if defined(MM_STATS)
+static mm_stats_t stats;
+#endif
+
 
 static inline address find_fit (uint32_t blkSize);
+#if defined(MM_BACKGROUND)
+static inline uint32_t mergeDeferred (uint32_t count);
+#endif
 
 static inline uint32_t sizeOf (tag* base) {
-  return *base & (uint32_t)-2;
+  return *base & SIZE_MASK;
 }
 
 static inline bool isAllocated (tag* base) {
@@ -42,6 +303,10 @@ static inline tag* header (address base) {
   return (tag*)base - 1;
 }
 
+static inline bool isGrown (address base) {
+  return *header(base) & GROWN_BIT;
+}
+
 static inline tag* footer (address base) {
   return (tag*)(base + sizeOf (header (base)) * sizeof (word) - 2 * sizeof (tag));
 }
@@ -62,28 +327,193 @@ static inline address prevBlock (address base) {
   return base - sizeOf (prevFooter (base)) * sizeof(word);
 }
 
-static inline address* nextPtr (address base) {
-  return (address*)base;
+#if defined(MM_COMPACT_LINKS)
+static inline address fromLink (freeLink l) {
+  return heap_lo + l;
 }
 
-static inline address* prevPtr (address base) {
-  return (address*)base + 1;
+static inline freeLink toLink (address base) {
+  return (freeLink)(base - heap_lo);
+}
+#else
+static inline address fromLink (freeLink l) {
+  return l;
+}
+
+static inline freeLink toLink (address base) {
+  return base;
+}
+#endif
+
+#if defined(MM_SIDE_TABLE)
+static inline uint32_t* sideSlot (address base) {
+  return &side_slots[(uintptr_t)(base - heap_lo) / DSIZE];
+}
+
+static inline sideDesc* descAt (uint32_t off) {
+  return (sideDesc*)((byte*)side_descs + off);
+}
+
+static inline sideDesc* descOf (address base) {
+  return descAt (*sideSlot (base));
+}
+
+static inline address descBlock (uint32_t off) {
+  return heap_lo + descAt (off)->block;
+}
+
+static inline address nextPtr (address base) {
+  return descBlock (descOf (base)->next);
+}
+
+static inline address prevPtr (address base) {
+  return descBlock (descOf (base)->prev);
 }
 
+static inline void setNext (address base, address next) {
+  descOf (base)->next = *sideSlot (next);
+}
+
+static inline void setPrev (address base, address prev) {
+  descOf (base)->prev = *sideSlot (prev);
+}
+
+/* Gives free block bp the next unused descriptor */
+static inline void sideAdd (address bp) {
+	uint32_t d = side_count++ * (uint32_t)sizeof(sideDesc);
+	*sideSlot (bp) = d;
+	descAt (d)->block = (uint32_t)(bp - heap_lo);
+	descAt (d)->size = sizeOf(header(bp));
+}
+
+/* Fills the hole left by unlinked block bp with the last descriptor */
+static inline void sideRemove (address bp) {
+	uint32_t d = *sideSlot (bp);
+	uint32_t last = --side_count * (uint32_t)sizeof(sideDesc);
+	if (d == last)
+		return;
+	sideDesc* desc = descAt (d);
+	*desc = *descAt (last);
+	*sideSlot (descBlock (d)) = d;
+	descAt (desc->next)->prev = d;
+	descAt (desc->prev)->next = d;
+}
+#else
+static inline address nextPtr (address base) {
+  return fromLink (*(freeLink*)base);
+}
+
+static inline address prevPtr (address base) {
+  return fromLink (*((freeLink*)base + 1));
+}
+
+static inline void setNext (address base, address next) {
+  *(freeLink*)base = toLink (next);
+}
+
+static inline void setPrev (address base, address prev) {
+  *((freeLink*)base + 1) = toLink (prev);
+}
+#endif
+
+#if defined(MM_FIT_INDEX)
+// A free block's slot in the index lives right after its links, or in its
+// descriptor
+static inline uint32_t* slotPtr (address base) {
+#if defined(MM_SIDE_TABLE)
+  return &descOf (base)->slot;
+#else
+  return (uint32_t*)((freeLink*)base + 2);
+#endif
+}
+
+static inline void indexAdd (address bp) {
+	if (fit_count == FIT_INDEX_CAP) {
+		*slotPtr(bp) = NO_FIT;
+		fit_overflow++;
+		return;
+	}
+	fit_sizes[fit_count] = sizeOf(header(bp));
+	fit_blocks[fit_count] = bp;
+	*slotPtr(bp) = fit_count++;
+}
+
+/* Fills the hole left by bp with the last slot */
+static inline void indexRemove (address bp) {
+	uint32_t slot = *slotPtr(bp);
+	if (slot == NO_FIT) {
+		fit_overflow--;
+		return;
+	}
+	fit_count--;
+	fit_sizes[slot] = fit_sizes[fit_count];
+	fit_blocks[slot] = fit_blocks[fit_count];
+	*slotPtr(fit_blocks[slot]) = slot;
+}
+
+/* Returns the first slot holding at least blkSize words, or NO_FIT */
+static inline uint32_t indexScan (uint32_t blkSize) {
+	uint32_t i = 0;
+	// Sizes never use the top bit, so signed compares are safe
+#if defined(__AVX2__)
+	const __m256i need = _mm256_set1_epi32 ((int)blkSize - 1);
+	for (; i + 8 <= fit_count; i += 8) {
+		__m256i sizes = _mm256_load_si256 ((const __m256i*)(fit_sizes + i));
+		int mask = _mm256_movemask_ps (_mm256_castsi256_ps (_mm256_cmpgt_epi32 (sizes, need)));
+		if (mask)
+			return i + (uint32_t)__builtin_ctz ((unsigned)mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i need = _mm_set1_epi32 ((int)blkSize - 1);
+	for (; i + 4 <= fit_count; i += 4) {
+		__m128i sizes = _mm_load_si128 ((const __m128i*)(fit_sizes + i));
+		int mask = _mm_movemask_ps (_mm_castsi128_ps (_mm_cmpgt_epi32 (sizes, need)));
+		if (mask)
+			return i + (uint32_t)__builtin_ctz ((unsigned)mask);
+	}
+#endif
+	for (; i < fit_count; i++) {
+		if (fit_sizes[i] >= blkSize)
+			return i;
+	}
+	return NO_FIT;
+}
+#endif
+
 /* Adds a node to the free list */
 static inline void addNode(address bp){
+#if defined(MM_SIDE_TABLE)
+	sideAdd (bp);
+#endif
 	address prev = free_list_head;
-	address next = *nextPtr(prev);
-	*nextPtr(bp) = next;
-	*prevPtr(bp) = prev;
-	*prevPtr(next) = bp;
-	*nextPtr(prev) = bp;
+	address next = nextPtr(prev);
+	setNext(bp, next);
+	setPrev(bp, prev);
+	setPrev(next, bp);
+	setNext(prev, bp);
+#if defined(MM_FIT_INDEX)
+	indexAdd (bp);
+#endif
 }
 
 /* Removes a node from the free list */
 static inline void removeNode (address bp){
-	*nextPtr(*prevPtr(bp)) = *nextPtr(bp);
-	*prevPtr(*nextPtr(bp)) = *prevPtr(bp);
+#if defined(MM_BACKGROUND)
+	if (bp == purge_cursor)
+		purge_cursor = nextPtr(bp);
+#endif
+#if defined(MM_HANDLES)
+	if (bp == lower_cursor)
+		lower_cursor = nextPtr(bp);
+#endif
+	setNext(prevPtr(bp), nextPtr(bp));
+	setPrev(nextPtr(bp), prevPtr(bp));
+#if defined(MM_FIT_INDEX)
+	indexRemove (bp);
+#endif
+#if defined(MM_SIDE_TABLE)
+	sideRemove (bp);
+#endif
 }
 
 /*basePtr, size, allocated */
@@ -102,6 +532,38 @@ static inline void toggleBlock (address bp){
 	*footer(bp) ^= 1;
 }
 
+/* linkedPages - the first page boundary past the links at the start of bp */
+static inline address linkedPages (address bp)
+{
+	return (address)(((uintptr_t)bp + LINK_BYTES + page_size - 1) & ~(page_size - 1));
+}
+
+/*
+ * purgeBounds - the whole pages of free block bp a purge hands back, past
+ * 		its links and before its footer
+ */
+static inline void purgeBounds (address bp, address* lo, address* hi)
+{
+	*lo = linkedPages (bp);
+	*hi = (address)((uintptr_t)footer (bp) & ~(page_size - 1));
+}
+
+/* keepPurged - marks block bp purged when the block it was cut from was */
+static inline void keepPurged (address bp, tag purged)
+{
+	*header(bp) |= purged;
+	*footer(bp) |= purged;
+}
+
+#if defined(MM_HANDLES)
+/* Moves the compactor's cursor back to bp if it fell inside bp's block */
+static inline void cursorInto (address bp)
+{
+	if (compact_cursor > bp && compact_cursor < nextBlock (bp))
+		compact_cursor = bp;
+}
+#endif
+
 /*
  *  Coalesce - merge free blocks with main memory pool
  */
@@ -109,11 +571,13 @@ static inline address coalesce(address bp)
 {
 	uint32_t size = sizeOf(header(bp));
 	address base = bp;
-	if (!isAllocated(nextHeader(bp))) {
+	// Sizes of at most SIZE_MASK words each can't overflow the sum, but the
+	// sum may not reach the flag bits
+	if (!isAllocated(nextHeader(bp)) && size + sizeOf(nextHeader(bp)) <= SIZE_MASK) {
 		size += sizeOf(nextHeader(bp));
 		removeNode(nextBlock(bp));
 	}
-	if (!isAllocated(prevFooter(bp))) {
+	if (!isAllocated(prevFooter(bp)) && size + sizeOf(prevFooter(bp)) <= SIZE_MASK) {
 		size += sizeOf(prevFooter(bp));
 		removeNode(prevBlock(bp));
 		base = prevBlock(bp);
@@ -121,6 +585,9 @@ static inline address coalesce(address bp)
 	if (size != sizeOf(header(bp))) {
 		removeNode(bp);
 		makeBlock(base, size, false);
+#if defined(MM_HANDLES)
+		cursorInto (base);
+#endif
 	}
 	return base;
 }
@@ -138,33 +605,139 @@ static inline uint32_t blocksFromBytes (uint32_t bytes) {
 	return size;
 }
 
+/*
+ * takeWild - moves the epilogue words further into the wilderness, first
+ * 		growing the wilderness by at least WILD_CHUNK bytes, or to the next
+ * 		huge page boundary, if it is short, and returns the payload of the untagged block left behind. Returns
+ * 		NULL when the heap can't grow.
+ */
+static inline address takeWild (uint32_t words)
+{
+	address bp = heap_top;
+	uintptr_t bytes = (uintptr_t)words * WSIZE;
+	if (bytes > HEAP_REACH - (uintptr_t)(bp - heap_lo))
+		return NULL;
+	if ((uintptr_t)(wild_end - bp) < bytes) {
+		uintptr_t need = bytes - (uintptr_t)(wild_end - bp);
+		// mem_sbrk takes an int
+		if (need > INT_MAX)
+			return NULL;
+		uintptr_t grow = need < WILD_CHUNK ? WILD_CHUNK : need;
+		if (huge_size != 0) {
+			uintptr_t size = (uintptr_t)(wild_end - heap_lo);
+			grow = ((size + grow + huge_size - 1) & ~(huge_size - 1)) - size;
+			if (grow > INT_MAX)
+				grow = need;
+		}
+		if (mem_sbrk ((int)grow) == (void *)-1) {
+			grow = need;
+			if (mem_sbrk ((int)grow) == (void *)-1)
+				return NULL;
+		}
+		wild_end += grow;
+	}
+	heap_top = bp + bytes;
+	*header (heap_top) = 0 | true;
+	return bp;
+}
+
 /*
  * extend_heap - grows the heap by a given word size to accomodate new blocks 
  */
 static inline address extend_heap(uint32_t words)
 {
 	words += (words & 1);
-	uint32_t size = words * WSIZE;
-	address bp = mem_sbrk ((int)size);
-	if ((uint64_t)bp == (uint64_t)-1)
+	if (words > SIZE_MASK)
+		return NULL;
+	address bp = takeWild (words);
+	if (bp == NULL)
 		return NULL;
-	/* Initialize free block header/footer and the epilogue header */
 	makeBlock (bp, words, false); 
-	*header (nextBlock (bp)) = 0 | true;
 	/* Coalesce if the previous block was free */
 	return coalesce (bp);
 }
 
 /*
- *PLACE - takes in a pointer and size, puts block of that size at the pointer.
+ * bump - allocates asize words straight off the wilderness with just the
+ * 		block's own tags and the epilogue to write. Returns NULL when the last
+ * 		block in the heap is free, since growing that block wastes less.
  */
-static inline address place(address bp, uint32_t asize)
+static inline address bump (uint32_t asize)
+{
+	if (!isAllocated(prevFooter(heap_top)))
+		return NULL;
+	address bp = takeWild (asize);
+	if (bp != NULL)
+		makeBlock (bp, asize, true);
+	return bp;
+}
+
+/*
+ * splitFront - carves the first words of free block bp off into their own
+ * 		free block and returns the free block that follows them
+ */
+static inline address splitFront (address bp, uint32_t words)
+{
+	uint32_t csize = sizeOf(header(bp));
+	tag purged = *header(bp) & PURGED_BIT;
+	removeNode (bp);
+	keepPurged (makeBlock (bp, words, false), purged);
+	address rest = makeBlock (nextBlock (bp), csize - words, false);
+	keepPurged (rest, purged);
+	return rest;
+}
+
+/*
+ * alignGap - words to skip at the front of free block bp so that the payload
+ * 		after them sits phase bytes past an align-byte boundary. The skipped
+ * 		words must be able to stand as a free block. Returns NO_FIT if asize
+ * 		words don't fit after them.
+ */
+static inline uint32_t alignGap (address bp, uint32_t asize, uintptr_t align, uintptr_t phase)
+{
+	uintptr_t gap = (align + phase - (uintptr_t)bp % align) % align;
+	while (gap != 0 && gap < MIN_BLOCK_SIZE * sizeof(word))
+		gap += align;
+	uint32_t skip = (uint32_t)(gap / sizeof(word));
+	if (skip + asize > sizeOf(header(bp)))
+		return NO_FIT;
+	return skip;
+}
+
+#if defined(MM_PAGE_AWARE)
+/*
+ * pageFit - moves a medium block that would straddle a page boundary to the
+ * 		start of the next page if free block bp is large enough
+ */
+static inline address pageFit (address bp, uint32_t asize)
+{
+	uintptr_t bytes = asize * sizeof(word) - 2 * sizeof(tag);
+	uintptr_t lo = (uintptr_t)bp;
+	if (bytes < PAGE_AWARE_MIN || bytes > page_size)
+		return bp;
+	if (lo / page_size == (lo + bytes - 1) / page_size)
+		return bp;
+	uint32_t skip = alignGap (bp, asize, page_size, 0);
+	// Skipping more than half the block fragments the heap more than it saves
+	if (skip == NO_FIT || skip * 2 > asize)
+		return bp;
+	return splitFront (bp, skip);
+}
+#endif
+
+/*
+ * carve - allocates asize words at the start of free block bp, splitting off
+ * 		the rest as a free block when it is large enough
+ */
+static inline address carve(address bp, uint32_t asize)
 {
 	uint32_t csize = sizeOf(header(bp));
+	tag purged = *header(bp) & PURGED_BIT;
 	removeNode (bp);
 	if (csize - asize >= MIN_BLOCK_SIZE) {
 		makeBlock (bp, asize, true);
-		makeBlock (nextBlock (bp), csize - asize, false);
+		// Nothing has written the inner pages of the rest yet
+		keepPurged (makeBlock (nextBlock (bp), csize - asize, false), purged);
 	} else {
 		makeBlock (bp, csize, true);
 	}
@@ -172,26 +745,573 @@ static inline address place(address bp, uint32_t asize)
 }
 
 /*
- *Find_fit - finds first available spot where a new block could fit
+ *PLACE - takes in a pointer and size, puts block of that size at the pointer.
  */
-static inline address find_fit (uint32_t blkSize) {
-	for(address blockPtr = *nextPtr(free_list_head); blockPtr != free_list_head; blockPtr = *nextPtr(blockPtr))
+static inline address place(address bp, uint32_t asize)
+{
+#if defined(MM_PAGE_AWARE)
+	bp = pageFit (bp, asize);
+#endif
+	return carve (bp, asize);
+}
+
+/*
+ * searchList - first fit over the free list, skipping blocks the index
+ * 		already covers when there is one
+ */
+static inline address searchList (uint32_t blkSize) {
+#if defined(MM_SIDE_TABLE)
+	// The sizes are in the descriptors, so no block is read until one fits
+	for (sideDesc* d = descAt (side_descs[0].next); d != side_descs; d = descAt (d->next)) {
+#if defined(MM_FIT_INDEX)
+		if (d->slot != NO_FIT)
+			continue;
+#endif
+		if (d->size >= blkSize)
+			return heap_lo + d->block;
+	}
+	return NULL;
+#else
+	for(address blockPtr = nextPtr(free_list_head); blockPtr != free_list_head; blockPtr = nextPtr(blockPtr))
 	{
+#if defined(MM_FIT_INDEX)
+		if (*slotPtr(blockPtr) != NO_FIT)
+			continue;
+#endif
 		if(sizeOf(header(blockPtr)) >= blkSize)
 		{
 			return blockPtr;
 		}
 	}
+	return NULL;
+#endif
+}
+
+/*
+ * searchFit - finds the first free block where a new block could fit, or
+ * 		NULL when there is none
+ */
+static inline address searchFit (uint32_t blkSize) {
+#if defined(MM_STATS)
+	uint64_t start = __rdtsc ();
+#endif
+#if defined(MM_FIT_INDEX)
+	uint32_t slot = indexScan (blkSize);
+	address bp = NULL;
+	if (slot != NO_FIT)
+		bp = fit_blocks[slot];
+	else if (fit_overflow != 0)
+		bp = searchList (blkSize);
+#else
+	address bp = searchList (blkSize);
+#endif
+#if defined(MM_STATS)
+	stats.fit_calls++;
+	stats.fit_cycles += __rdtsc () - start;
+#endif
+	return bp;
+}
+
+/*
+ * reclaimFit - searchFit, tried again after merging the deferred frees when
+ * 		no free block fits
+ */
+static inline address reclaimFit (uint32_t blkSize) {
+	address bp = searchFit (blkSize);
+#if defined(MM_BACKGROUND)
+	if (bp == NULL && mergeDeferred (UINT32_MAX) != 0)
+		bp = searchFit (blkSize);
+#endif
+	return bp;
+}
+
+/*
+ *Find_fit - finds first available spot where a new block could fit,
+ * 		growing the heap when no free block fits
+ */
+static inline address find_fit (uint32_t blkSize) {
+	address bp = reclaimFit (blkSize);
+	if (bp != NULL)
+		return bp;
 	return extend_heap(blkSize);
 }
 
-int
-mm_init (void)
+/*
+ * findAligned - like find_fit, but returns a free block whose payload sits
+ * 		phase bytes past an align-byte boundary. Any words skipped in front of
+ * 		it are split off as their own free block.
+ */
+static inline address findAligned (uint32_t asize, uintptr_t align, uintptr_t phase)
+{
+	for (address bp = nextPtr(free_list_head); bp != free_list_head; bp = nextPtr(bp)) {
+		uint32_t skip = alignGap (bp, asize, align, phase);
+		if (skip != NO_FIT) {
+			return skip ? splitFront (bp, skip) : bp;
+		}
+	}
+#if defined(MM_BACKGROUND)
+	if (mergeDeferred (UINT32_MAX) != 0)
+		return findAligned (asize, align, phase);
+#endif
+	address bp = extend_heap (asize + (uint32_t)(align / WSIZE) + MIN_BLOCK_SIZE);
+	if (bp == NULL) {
+		return NULL;
+	}
+	uint32_t skip = alignGap (bp, asize, align, phase);
+	return skip ? splitFront (bp, skip) : bp;
+}
+
+/*
+ * streamCopy - copies bytes from src to dst (both 16 byte aligned) with
+ * 		non-temporal stores that bypass the cache
+ */
+static inline void streamCopy (address dst, address src, uint32_t bytes)
+{
+#if defined(__SSE2__)
+	uint32_t i = 0;
+	for (; i + 64 <= bytes; i += 64) {
+		__m128i a = _mm_load_si128 ((const __m128i*)(src + i));
+		__m128i b = _mm_load_si128 ((const __m128i*)(src + i + 16));
+		__m128i c = _mm_load_si128 ((const __m128i*)(src + i + 32));
+		__m128i d = _mm_load_si128 ((const __m128i*)(src + i + 48));
+		_mm_stream_si128 ((__m128i*)(dst + i), a);
+		_mm_stream_si128 ((__m128i*)(dst + i + 16), b);
+		_mm_stream_si128 ((__m128i*)(dst + i + 32), c);
+		_mm_stream_si128 ((__m128i*)(dst + i + 48), d);
+	}
+	_mm_sfence ();
+	memcpy (dst + i, src + i, bytes - i);
+#else
+	memcpy (dst, src, bytes);
+#endif
+}
+
+/*
+ * movePayload - moves a realloc'd payload to its new block. When both sit at
+ * 		the same offset within a page, the whole pages in between are remapped
+ * 		and only the partial pages at either end are copied.
+ */
+static inline void movePayload (address dst, address src, uint32_t bytes)
+{
+	if (bytes >= REMAP_MIN && ((uintptr_t)dst - (uintptr_t)src) % page_size == 0) {
+		uint32_t head = (uint32_t)((page_size - (uintptr_t)src % page_size) % page_size);
+		uint32_t pages = (uint32_t)((bytes - head) / page_size * page_size);
+		if (mem_remap (dst + head, src + head, pages) == 0) {
+			memcpy (dst, src, head);
+			memcpy (dst + head + pages, src + head + pages, bytes - head - pages);
+#if defined(MM_STATS)
+			stats.realloc_remapped += pages;
+			stats.realloc_copied += bytes - pages;
+#endif
+			return;
+		}
+	}
+#if defined(MM_STATS)
+	stats.realloc_copied += bytes;
+#endif
+	if (bytes >= STREAM_COPY_MIN) {
+		streamCopy (dst, src, bytes);
+	} else {
+		memcpy (dst, src, bytes);
+	}
+}
+
+/*
+ * retractWild - gives free block bp back to the wilderness if it is the last
+ * 		block in the heap, so the next growth phase bumps through it again
+ */
+static inline void retractWild (address bp)
+{
+	if (nextBlock (bp) == heap_top) {
+		removeNode (bp);
+		heap_top = bp;
+		*header (heap_top) = 0 | true;
+#if defined(MM_HANDLES)
+		if (compact_cursor > heap_top)
+			compact_cursor = heap_top;
+#endif
+	}
+}
+
+/*
+ * trimWild - hands the whole pages past the epilogue back with mem_sbrk,
+ * 		or whole huge pages on those, but for the first keep bytes
+ */
+static inline void trimWild (uintptr_t keep)
+{
+	// The driver resets the brk before mm_init starts a new heap, and the
+	// maintenance thread may still be freeing into the old one
+	if ((address)mem_heap_hi () + 1 != wild_end)
+		return;
+	uintptr_t unit = huge_size != 0 ? huge_size : page_size;
+	uintptr_t used = ((uintptr_t)(heap_top - heap_lo) + keep + unit - 1) & ~(unit - 1);
+	uintptr_t size = (uintptr_t)(wild_end - heap_lo);
+	if (size <= used)
+		return;
+	// mem_sbrk takes an int, so a huge wilderness goes over several calls
+	uintptr_t cut = size - used;
+	if (cut > INT_MAX)
+		cut = (uintptr_t)INT_MAX & ~(unit - 1);
+	if (mem_sbrk (-(int)cut) != (void *)-1)
+		wild_end -= cut;
+}
+
+#if defined(MM_PURGE)
+/*
+ * purgeBlock - hands the inner pages of free block bp back to the kernel,
+ * 		and marks it purged if that worked
+ */
+static inline void purgeBlock (address bp)
+{
+	address lo, hi;
+	purgeBounds (bp, &lo, &hi);
+	if (lo < hi && mem_purge (lo, (size_t)(hi - lo)) == 0) {
+		*header(bp) |= PURGED_BIT;
+		*footer(bp) |= PURGED_BIT;
+	}
+}
+#endif
+
+/*
+ * releaseBlock - frees an allocated block and merges it with its neighbours
+ */
+static inline void releaseBlock (address bp)
+{
+	toggleBlock (bp);
+	addNode (bp);
+	bp = coalesce (bp);
+#if defined(MM_PURGE)
+	// The last block goes back to the wilderness instead, which gives its
+	// pages back with the brk once it is as long
+	if (nextBlock (bp) != heap_top) {
+		if (sizeOf(header(bp)) * WSIZE >= PURGE_MIN && !(*header(bp) & PURGED_BIT))
+			purgeBlock (bp);
+		return;
+	}
+	retractWild (bp);
+	if ((uintptr_t)(wild_end - heap_top) >= PURGE_MIN)
+		trimWild (WILD_CHUNK);
+#else
+	retractWild (bp);
+#endif
+}
+
+static inline void lockHeap (void)
+{
+#if defined(MM_BACKGROUND)
+	pthread_mutex_lock (&heap_lock);
+#endif
+}
+
+static inline void unlockHeap (void)
+{
+#if defined(MM_BACKGROUND)
+	pthread_mutex_unlock (&heap_lock);
+#endif
+}
+
+#if defined(MM_BACKGROUND)
+/*
+ * mergeDeferred - frees up to count deferred frees for real, taking the
+ * 		stack over whenever the ones in hand run out. Returns how many it
+ * 		freed. The heap lock must be held.
+ */
+static inline uint32_t mergeDeferred (uint32_t count)
+{
+	uint32_t n = 0;
+	for (; n < count; n++) {
+		if (merging == NULL &&
+		    (merging = __atomic_exchange_n (&deferred, NULL, __ATOMIC_ACQUIRE)) == NULL)
+			break;
+		address bp = merging;
+		merging = *(address*)bp;
+		releaseBlock (bp);
+	}
+	return n;
+}
+
+/*
+ * purgeFree - purges the inner pages of the free blocks of at least
+ * 		bg_purge_min bytes that haven't been yet, from purge_cursor to the
+ * 		end of the free list. A block is taken off the list and tagged
+ * 		allocated while its pages go, so the heap lock isn't held across the
+ * 		madvise. Its links and tags stay.
+ */
+static void purgeFree (void)
+{
+	uint32_t min = __atomic_load_n (&bg_purge_min, __ATOMIC_RELAXED);
+	uint32_t visits = 0;
+	pthread_mutex_lock (&purge_lock);
+	lockHeap ();
+	while (min != 0 && purge_cursor != free_list_head) {
+		address bp = purge_cursor;
+		purge_cursor = nextPtr (bp);
+		address lo, hi;
+		purgeBounds (bp, &lo, &hi);
+		if ((*header(bp) & PURGED_BIT) || sizeOf(header(bp)) * WSIZE < min || hi <= lo) {
+			if (++visits % BG_SLICE == 0) {
+				unlockHeap ();
+				lockHeap ();
+			}
+			continue;
+		}
+		removeNode (bp);
+		toggleBlock (bp);
+		unlockHeap ();
+		bool purged = mem_purge (lo, (size_t)(hi - lo)) == 0;
+		lockHeap ();
+		toggleBlock (bp);
+		if (purged) {
+			*header(bp) |= PURGED_BIT;
+			*footer(bp) |= PURGED_BIT;
+		}
+		addNode (bp);
+		retractWild (coalesce (bp));
+	}
+	purge_cursor = nextPtr (free_list_head);
+	unlockHeap ();
+	pthread_mutex_unlock (&purge_lock);
+}
+
+/*
+ * maintain - the maintenance thread. Each round merges the deferred frees,
+ * 		trims the wilderness and purges large free blocks.
+ */
+static void* maintain (void* arg)
+{
+	(void)arg;
+	for (;;) {
+		uint32_t us = __atomic_load_n (&bg_interval, __ATOMIC_RELAXED);
+		if (us == 0)
+			us = BG_INTERVAL_US;
+		struct timespec nap = { (time_t)(us / 1000000), (long)(us % 1000000) * 1000 };
+		nanosleep (&nap, NULL);
+		if (__atomic_load_n (&bg_interval, __ATOMIC_RELAXED) == 0)
+			continue;
+		pthread_mutex_lock (&round_lock);
+		if (bg_paused) {
+			pthread_mutex_unlock (&round_lock);
+			continue;
+		}
+		uint32_t merged;
+		do {
+			lockHeap ();
+			merged = mergeDeferred (BG_SLICE);
+			unlockHeap ();
+		} while (merged == BG_SLICE);
+		lockHeap ();
+		trimWild (BG_TRIM_KEEP);
+		unlockHeap ();
+		purgeFree ();
+		pthread_mutex_unlock (&round_lock);
+	}
+	return NULL;
+}
+
+static void startMaintainer (void)
+{
+	pthread_t thread;
+	if (pthread_create (&thread, NULL, maintain, NULL) != 0) {
+		bg_interval = 0;
+		return;
+	}
+	pthread_detach (thread);
+}
+#endif
+
+#if defined(MM_SMALL_SPANS)
+/* Bytes at the start of a span taken by its head, before the first object */
+static inline uint32_t spanHead (void)
+{
+	return (uint32_t)((sizeof(spanDesc) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1));
+}
+
+static inline address spanObjects (spanDesc* s)
+{
+	return (address)s + spanHead ();
+}
+
+/*
+ * mapLookup - the map entry for the page bp is in, or 0 when that page
+ * 		isn't part of a span
+ */
+static inline uintptr_t mapLookup (address bp)
+{
+#if defined(MM_STATS)
+	uint64_t start = __rdtsc ();
+#endif
+	uintptr_t page = (uintptr_t)(bp - heap_lo) >> SPAN_PAGE_SHIFT;
+	uintptr_t entry = 0;
+	if (page >> MAP_LEAF_BITS < MAP_ROOT_SIZE) {
+		uintptr_t* leaf = span_map[page >> MAP_LEAF_BITS];
+		if (leaf != NULL)
+			entry = leaf[page & (MAP_LEAF_SIZE - 1)];
+	}
+#if defined(MM_STATS)
+	stats.map_lookups++;
+	stats.map_cycles += __rdtsc () - start;
+#endif
+	return entry;
+}
+
+/*
+ * mapSpan - points the map entries of the pages from start on at entry,
+ * 		allocating leaves as they are needed. Returns false if a leaf
+ * 		couldn't be allocated.
+ */
+static inline bool mapSpan (address start, uint32_t pages, uintptr_t entry)
+{
+	uintptr_t first = (uintptr_t)(start - heap_lo) >> SPAN_PAGE_SHIFT;
+	for (uintptr_t page = first; page < first + pages; page++) {
+		uintptr_t** leaf = &span_map[page >> MAP_LEAF_BITS];
+		if (*leaf == NULL) {
+			if (entry == 0)
+				continue;
+			uint32_t asize = blocksFromBytes (MAP_LEAF_SIZE * sizeof(uintptr_t));
+			address bp = find_fit (asize);
+			if (bp == NULL)
+				return false;
+			*leaf = (uintptr_t*)place (bp, asize);
+			memset (*leaf, 0, MAP_LEAF_SIZE * sizeof(uintptr_t));
+#if defined(MM_STATS)
+			stats.map_bytes += MAP_LEAF_SIZE * sizeof(uintptr_t);
+#endif
+		}
+		(*leaf)[page & (MAP_LEAF_SIZE - 1)] = entry;
+	}
+	return true;
+}
+
+static inline void spanPush (spanDesc* s)
+{
+	spanDesc** head = &span_queues[s->sizeClass];
+	s->prev = NULL;
+	s->next = *head;
+	if (*head != NULL)
+		(*head)->prev = s;
+	*head = s;
+}
+
+static inline void spanRemove (spanDesc* s)
+{
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		span_queues[s->sizeClass] = s->next;
+}
+
+/*
+ * newSpan - carves a span for class c out of the heap, maps its pages and
+ * 		puts it on the class queue. The fewest pages that waste at most
+ * 		1/SPAN_WASTE of the span are used.
+ */
+static spanDesc* newSpan (uint32_t c)
+{
+	uint32_t objSize = classSize (c);
+	// The span's footer and the next block's header take the last bytes of
+	// its last page, so spans can sit back to back
+	uint32_t head = spanHead () + 2 * (uint32_t)sizeof(tag);
+	uint32_t pages = 1;
+	while (pages < SPAN_MAX_PAGES &&
+	       (pages * SPAN_PAGE - head) % objSize * SPAN_WASTE > pages * SPAN_PAGE)
+		pages++;
+	uint32_t asize = blocksFromBytes (pages * SPAN_PAGE - 2 * (uint32_t)sizeof(tag));
+	address bp = findAligned (asize, SPAN_PAGE, 0);
+	if (bp == NULL)
+		return NULL;
+	bp = carve (bp, asize);
+	spanDesc* s = (spanDesc*)bp;
+	if (!mapSpan (bp, pages, (uintptr_t)s | c)) {
+		mapSpan (bp, pages, 0);
+		releaseBlock (bp);
+		return NULL;
+	}
+	s->free = NULL;
+	s->objSize = objSize;
+	s->pages = (uint16_t)pages;
+	s->used = s->capacity = 0;
+	s->reserved = (uint16_t)((pages * SPAN_PAGE - head) / objSize);
+	s->sizeClass = (uint8_t)c;
+	s->full = false;
+	spanPush (s);
+	return s;
+}
+
+/*
+ * spanMalloc - pops an object of class c from the first span on its queue
+ * 		with one left, moving full spans off the queue on the way
+ */
+static inline address spanMalloc (uint32_t c)
+{
+	spanDesc* s = span_queues[c];
+	while (s != NULL && s->free == NULL && s->capacity == s->reserved) {
+		spanDesc* next = s->next;
+		spanRemove (s);
+		s->full = true;
+		s = next;
+	}
+	if (s == NULL && (s = newSpan (c)) == NULL)
+		return NULL;
+	address bp = s->free;
+	if (bp != NULL)
+		s->free = *(address*)bp;
+	else
+		bp = spanObjects (s) + (size_t)s->capacity++ * s->objSize;
+	s->used++;
+	return bp;
+}
+
+/*
+ * spanFree - returns an object to its span. A span that empties goes back
+ * 		to the heap unless it is the last one its class has.
+ */
+static inline void spanFree (uintptr_t entry, address bp)
+{
+	spanDesc* s = (spanDesc*)(entry & ~(uintptr_t)(SPAN_PAGE - 1));
+	*(address*)bp = s->free;
+	s->free = bp;
+	s->used--;
+	if (s->full) {
+		s->full = false;
+		spanPush (s);
+	}
+	if (s->used == 0 && (span_queues[s->sizeClass] != s || s->next != NULL)) {
+		spanRemove (s);
+		mapSpan ((address)s, s->pages, 0);
+		releaseBlock ((address)s);
+	}
+}
+#endif
+
+/*
+ * initHeap - starts an empty heap in what memlib hands out
+ */
+static int
+initHeap (void)
 {
 	address heap_head;
 	//create the initial heap	
 	if ((heap_head = mem_sbrk(6*WSIZE)) == (void *)-1)
 		return -1;
+	heap_lo = (address)mem_heap_lo();
+	heap_top = wild_end = heap_head + 6 * WSIZE;
+	page_size = mem_pagesize();
+	huge_size = mem_huge_pages() ? mem_hugepagesize() : 0;
+#if defined(MM_FIT_INDEX)
+	fit_count = fit_overflow = 0;
+#endif
+#if defined(MM_STATS)
+	memset (&stats, 0, sizeof(stats));
+#endif
+#if defined(MM_SMALL_SPANS)
+	memset (span_map, 0, sizeof(span_map));
+	memset (span_queues, 0, sizeof(span_queues));
+#if defined(MM_STATS)
+	stats.map_bytes = sizeof(span_map);
+#endif
+#endif
 	// setuo a buffer
 	free_list_head = heap_head + 2 * WSIZE;
 	// we make a dummy header and store it between a dummy header and footer of size
@@ -200,9 +1320,25 @@ mm_init (void)
 	makeBlock(free_list_head, 4, true);
 	// Set the epilogue header. 
 	*header(nextBlock(free_list_head)) = 0 | 1;
+#if defined(MM_SIDE_TABLE)
+	side_count = 0;
+	sideAdd (free_list_head);
+#endif
 	// Setup the doubly linked list which points to itself.
-	*prevPtr(free_list_head) = free_list_head;
-	*nextPtr(free_list_head) = free_list_head;
+	setPrev(free_list_head, free_list_head);
+	setNext(free_list_head, free_list_head);
+#if defined(MM_HANDLES)
+	handle_next = 1;
+	handle_free = 0;
+	compact_cursor = heap_top;
+	lower_cursor = NULL;
+#endif
+#if defined(MM_BACKGROUND)
+	// Frees into the old heap are dropped with it
+	__atomic_store_n (&deferred, NULL, __ATOMIC_RELAXED);
+	merging = NULL;
+	purge_cursor = free_list_head;
+#endif
 	/*
 	 * Extend heap by 1 block of chunksize bytes.
 	 * Chunksize is equal to 3 words of space, as this accounts for the overhead of a header and footer word.
@@ -210,33 +1346,256 @@ mm_init (void)
 	return 0;
 }
 
+int
+mm_init (void)
+{
+#if defined(MM_BACKGROUND)
+	pthread_mutex_lock (&purge_lock);
+	lockHeap ();
+	int ok = initHeap ();
+	unlockHeap ();
+	pthread_mutex_unlock (&purge_lock);
+	// Only once there is a heap for the thread to look after
+	if (ok == 0)
+		pthread_once (&maintainer_once, startMaintainer);
+	return ok;
+#else
+	return initHeap ();
+#endif
+}
+
+#if defined(MM_BACKGROUND)
+/*
+ * mm_background_tune - sets how often the maintenance thread wakes, in
+ * 		microseconds, and the smallest free block whose pages it purges.
+ * 		An interval of 0 stops the upkeep, after which mm_free frees right
+ * 		away; a purge_min of 0 stops the purging alone.
+ */
+void
+mm_background_tune (uint32_t interval_us, uint32_t purge_min)
+{
+	lockHeap ();
+	__atomic_store_n (&bg_interval, interval_us, __ATOMIC_RELAXED);
+	__atomic_store_n (&bg_purge_min, purge_min, __ATOMIC_RELAXED);
+	if (interval_us == 0)
+		mergeDeferred (UINT32_MAX);
+	unlockHeap ();
+}
+
+/*
+ * mm_background_pause - with pause set, waits for the maintenance thread to
+ * 		finish the round it is in, merges the deferred frees and keeps the
+ * 		thread out of the heap until it is called again with pause clear.
+ * 		The heap's memory can be reset or released in between.
+ */
+void
+mm_background_pause (int pause)
+{
+	pthread_mutex_lock (&round_lock);
+	bg_paused = pause != 0;
+	if (bg_paused) {
+		lockHeap ();
+		mergeDeferred (UINT32_MAX);
+		unlockHeap ();
+	}
+	pthread_mutex_unlock (&round_lock);
+}
+#endif
+
+/*
+ * allocate - finds or makes a block of asize words, with the heap lock held.
+ * 		When it comes out of a purged free block, the pages of that block
+ * 		still known to be zero are left in [*zeroLo, *zeroHi).
+ */
+static inline address allocate (uint32_t asize, address* zeroLo, address* zeroHi)
+{
+	address bp = reclaimFit(asize);
+	if (bp == NULL) {
+		bp = bump(asize);
+		if (bp == NULL && (bp = extend_heap(asize)) != NULL)
+			bp = place(bp, asize);
+	} else {
+		if (*header(bp) & PURGED_BIT)
+			purgeBounds (bp, zeroLo, zeroHi);
+		bp = place(bp, asize);
+	}
+	return bp;
+}
+
 void*
 mm_malloc (uint32_t size)
 {
 	if (size == 0) {
 		return NULL;
 	}
+	lockHeap ();
+	address bp;
+#if defined(MM_SMALL_SPANS)
+	if (size <= SPAN_OBJ_MAX) {
+		bp = spanMalloc (classOf (size));
+		unlockHeap ();
+		return bp;
+	}
+#endif
+	address lo, hi;
+	bp = allocate (blocksFromBytes(size), &lo, &hi);
+	unlockHeap ();
+	return bp;
+}
+
+/*
+ * mm_calloc - a zeroed payload for nmemb elements of size bytes. Pages that
+ * 		were purged and haven't been written since already read as zero, so
+ * 		only the rest of the payload gets cleared.
+ */
+void*
+mm_calloc (uint32_t nmemb, uint32_t size)
+{
+	if (nmemb != 0 && size > UINT32_MAX / nmemb) {
+		return NULL;
+	}
+	uint32_t bytes = nmemb * size;
+#if defined(MM_SMALL_SPANS)
+	if (bytes <= SPAN_OBJ_MAX) {
+		address bp = mm_malloc (bytes);
+		if (bp != NULL)
+			memset (bp, 0, bytes);
+		return bp;
+	}
+#endif
+	if (bytes == 0) {
+		return NULL;
+	}
+	address lo = NULL, hi = NULL;
+	lockHeap ();
+	address bp = allocate (blocksFromBytes(bytes), &lo, &hi);
+	unlockHeap ();
+	if (bp == NULL) {
+		return NULL;
+	}
+	address end = bp + bytes;
+	// pageFit may have moved the block up and linked it at its new start
+	if (lo < linkedPages (bp))
+		lo = linkedPages (bp);
+	if (hi > end)
+		hi = end;
+	if (lo >= hi) {
+		memset (bp, 0, bytes);
+	} else {
+		memset (bp, 0, (size_t)(lo - bp));
+		memset (hi, 0, (size_t)(end - hi));
+	}
+	return bp;
+}
+
+/*
+ * mm_memalign - like mm_malloc, but the payload is aligned to alignment bytes,
+ * 		which must be a power of two. Blocks are carved out of the first free
+ * 		block with room for an aligned payload; the bytes skipped in front of
+ * 		it stay on the free list.
+ */
+void*
+mm_memalign (uint32_t alignment, uint32_t size)
+{
+	if (alignment <= ALIGNMENT) {
+		return mm_malloc (size);
+	}
+	if (size == 0 || (alignment & (alignment - 1)) != 0) {
+		return NULL;
+	}
 	uint32_t asize = blocksFromBytes(size);
-	address bp = find_fit(asize);
+	lockHeap ();
+	address bp = findAligned (asize, alignment, 0);
 	if (bp != NULL) {
-		place(bp, asize);
+		bp = carve (bp, asize);
 	}
+	unlockHeap ();
 	return bp;
 }
 
+/*
+ * mm_malloc_cacheline - a block that owns every cache line it touches: the
+ * 		payload starts on a line and is padded to a whole number of lines, so
+ * 		hot objects never share a line with a neighbour's data or tags.
+ */
+void*
+mm_malloc_cacheline (uint32_t size)
+{
+	return mm_memalign (MM_CACHELINE, (size + MM_CACHELINE - 1) & ~(uint32_t)(MM_CACHELINE - 1));
+}
+
 /* We need to add the node to the freed block in this
    implementation to make sure our list contains everything
    that's been freed. */
 void
 mm_free (void *ptr)
 {
-	toggleBlock((address)ptr);
-	addNode(ptr);
-	coalesce ((address)ptr);
+#if defined(MM_SMALL_SPANS)
+	uintptr_t entry = mapLookup ((address)ptr);
+	if (entry != 0) {
+		lockHeap ();
+		spanFree (entry, (address)ptr);
+		unlockHeap ();
+		return;
+	}
+#endif
+#if defined(MM_BACKGROUND)
+	if (__atomic_load_n (&bg_interval, __ATOMIC_RELAXED) != 0) {
+		address bp = (address)ptr;
+		address top = __atomic_load_n (&deferred, __ATOMIC_RELAXED);
+		do {
+			*(address*)bp = top;
+		} while (!__atomic_compare_exchange_n (&deferred, &top, bp, true,
+		                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		return;
+	}
+#endif
+	lockHeap ();
+	releaseBlock ((address)ptr);
+	unlockHeap ();
 }
 
-void*
-mm_realloc (void *ptr, uint32_t size)
+/*
+ * growBlock - tries to grow bp to blkSize in place, by absorbing the free
+ * 		block after it and/or extending the heap when bp sits at the end
+ * 		of the heap. Returns false if bp has to move.
+ */
+static inline bool growBlock (address bp, uint32_t blkSize)
+{
+	uint32_t size = sizeOf(header(bp));
+	address next = nextBlock(bp);
+	if (!isAllocated(header(next))) {
+		size += sizeOf(header(next));
+		next = nextBlock(next);
+	}
+	if (size < blkSize && sizeOf(header(next)) != 0) {
+		return false;
+	}
+	if (size < blkSize) {
+		if (takeWild (blkSize - size) == NULL)
+			return false;
+		size = blkSize;
+	}
+	if (!isAllocated(nextHeader(bp))) {
+		removeNode(nextBlock(bp));
+	}
+	if (size - blkSize >= MIN_BLOCK_SIZE) {
+		makeBlock (bp, blkSize, true);
+		makeBlock (nextBlock (bp), size - blkSize, false);
+	} else {
+		makeBlock (bp, size, true);
+	}
+#if defined(MM_HANDLES)
+	cursorInto (bp);
+#endif
+	return true;
+}
+
+/*
+ * resize - mm_realloc, with the heap lock held
+ */
+static void*
+resize (void *ptr, uint32_t size)
 {
 	if (ptr == NULL) {
 		return mm_malloc (size);
@@ -246,6 +1605,23 @@ mm_realloc (void *ptr, uint32_t size)
 		return NULL;
 	}
 	address bp = (address)ptr;
+#if defined(MM_SMALL_SPANS)
+	uintptr_t entry = mapLookup (bp);
+	if (entry != 0) {
+		uint32_t objSize = classSize ((uint32_t)(entry & (SPAN_PAGE - 1)));
+		if (size <= objSize && size > objSize / 2) {
+			return ptr;
+		}
+		address newPtr = mm_malloc (size);
+		if (newPtr == NULL) {
+			return NULL;
+		}
+		memcpy (newPtr, bp, size < objSize ? size : objSize);
+		spanFree (entry, bp);
+		return newPtr;
+	}
+#endif
+	const bool grown = isGrown(bp);
 	const uint32_t newBlocks = blocksFromBytes (size);
 	const uint32_t oldBlocks = sizeOf(header((address)ptr));
 	const uint32_t payload = (uint32_t)(oldBlocks * sizeof(word) - 2 * sizeof(tag));
@@ -253,19 +1629,286 @@ mm_realloc (void *ptr, uint32_t size)
 		return ptr;
 	}
 	if (newBlocks < oldBlocks) {
-		if (oldBlocks - newBlocks >= 2) {
+		// Keep the headroom of a growing block unless it shrinks by half
+		if (grown && newBlocks >= oldBlocks / 2) {
+			return ptr;
+		}
+		if (oldBlocks - newBlocks >= MIN_BLOCK_SIZE) {
 			makeBlock (bp, newBlocks, true);
 			makeBlock (nextBlock (bp), oldBlocks - newBlocks, false);
+			coalesce (nextBlock (bp));
 		}
 		return ptr;
 	}
-	address newPtr = mm_malloc(size);
-	memcpy (newPtr, ptr, payload);
-	mm_free (ptr);
-	return newPtr;
+	// A block that grows a second time is likely to keep growing, so
+	// round it up geometrically to make repeated growth amortized O(1).
+	uint32_t blkSize = newBlocks;
+	if (grown) {
+		uint32_t headroom = newBlocks / 2;
+		if (headroom > REALLOC_HEADROOM_CAP)
+			headroom = REALLOC_HEADROOM_CAP;
+		blkSize += headroom + (headroom & 1);
+	}
+	if (!growBlock (bp, blkSize)) {
+		address newPtr;
+		// Large payloads go where their pages line up with the old ones
+		if (payload >= REMAP_MIN)
+			newPtr = findAligned (blkSize, page_size, (uintptr_t)bp % page_size);
+		else
+			newPtr = find_fit (blkSize);
+		if (newPtr == NULL)
+			return NULL;
+		newPtr = payload >= REMAP_MIN ? carve (newPtr, blkSize) : place (newPtr, blkSize);
+		movePayload (newPtr, bp, payload);
+		mm_free (ptr);
+		bp = newPtr;
+	}
+	*header(bp) |= GROWN_BIT;
+	return bp;
 }
 
-int mm_check(void)
+void*
+mm_realloc (void *ptr, uint32_t size)
+{
+	lockHeap ();
+	void* p = resize (ptr, size);
+	unlockHeap ();
+	return p;
+}
+
+#if defined(MM_HANDLES)
+/*
+ * handleBlock - mm_halloc, with the heap lock held
+ */
+static mm_handle_t
+handleBlock (uint32_t size)
+{
+	uint32_t h = handle_free;
+	if (h == 0 && handle_next == HANDLE_MAX)
+		return 0;
+	uint32_t asize = blocksFromBytes (size + DSIZE);
+	address bp = reclaimFit (asize);
+	if (bp == NULL) {
+		if ((bp = bump (asize)) == NULL && (bp = extend_heap (asize)) != NULL)
+			bp = place (bp, asize);
+	} else {
+		bp = place (bp, asize);
+	}
+	if (bp == NULL)
+		return 0;
+	if (h != 0)
+		handle_free = handle_table[h].nextFree;
+	else
+		h = handle_next++;
+	*header(bp) |= HANDLE_BIT;
+	*(uint32_t*)bp = h;
+	handle_table[h].bp = bp;
+	handle_table[h].pins = 0;
+	return h;
+}
+
+/*
+ * mm_halloc - allocates a movable block of size bytes and returns its handle,
+ * 		or 0 when out of memory or handles. The block stays put only while
+ * 		it is locked with mm_hlock.
+ */
+mm_handle_t
+mm_halloc (uint32_t size)
+{
+	lockHeap ();
+	mm_handle_t h = handleBlock (size);
+	unlockHeap ();
+	return h;
+}
+
+/* Whether h names a handle mm_halloc returned and mm_hfree hasn't freed */
+static inline bool liveHandle (mm_handle_t h)
+{
+	return h != 0 && h < handle_next && handle_table[h].bp != NULL;
+}
+
+/*
+ * mm_hlock - pins the block of handle h and returns its payload, which stays
+ * 		valid until the matching mm_hunlock. Returns NULL when h isn't a live
+ * 		handle.
+ */
+void*
+mm_hlock (mm_handle_t h)
+{
+	if (!liveHandle (h))
+		return NULL;
+	handle_table[h].pins++;
+	return handle_table[h].bp + DSIZE;
+}
+
+/*
+ * mm_hunlock - undoes one mm_hlock of handle h. Does nothing when h isn't a
+ * 		live handle or isn't locked.
+ */
+void
+mm_hunlock (mm_handle_t h)
+{
+	if (!liveHandle (h) || handle_table[h].pins == 0)
+		return;
+	handle_table[h].pins--;
+}
+
+/*
+ * mm_hfree - frees the block of handle h and the handle itself. Does nothing
+ * 		when h isn't a live handle.
+ */
+void
+mm_hfree (mm_handle_t h)
+{
+	if (!liveHandle (h))
+		return;
+	lockHeap ();
+	*header(handle_table[h].bp) &= ~HANDLE_BIT;
+	releaseBlock (handle_table[h].bp);
+	handle_table[h].bp = NULL;
+	handle_table[h].nextFree = handle_free;
+	handle_free = h;
+	unlockHeap ();
+}
+
+/* Whether bp is an allocated handle block that isn't locked */
+static inline bool movable (address bp)
+{
+	return (*header(bp) & HANDLE_BIT) && handle_table[*(uint32_t*)bp].pins == 0;
+}
+
+/*
+ * slideDown - moves the unpinned handle block after free block bp down to
+ * 		bp's start, leaving the free space after it. Returns the free block,
+ * 		merged with whatever free block followed the moved one.
+ */
+static inline address slideDown (address bp)
+{
+	uint32_t gap = sizeOf(header(bp));
+	address next = nextBlock (bp);
+	uint32_t size = sizeOf(header(next));
+	removeNode (bp);
+	// The whole block moves, tags and all
+	memmove (header(bp), header(next), size * WSIZE);
+	handle_table[*(uint32_t*)bp].bp = bp;
+	address rest = makeBlock (nextBlock (bp), gap, false);
+	return coalesce (rest);
+}
+
+/*
+ * findLower - a free block below limit with room for size words, or NULL.
+ * 		Adds the blocks it looked at to work, and once work reaches budget
+ * 		stops with lower_cursor set, so the next call for the same limit
+ * 		resumes the walk there.
+ */
+static inline address findLower (uint32_t size, address limit, uint64_t* work, uint32_t budget)
+{
+	address bp = nextPtr(free_list_head);
+	if (lower_cursor != NULL && lower_for == limit)
+		bp = lower_cursor;
+	lower_cursor = NULL;
+	lower_for = limit;
+	for (; bp != free_list_head; bp = nextPtr(bp)) {
+		if (bp < limit && sizeOf(header(bp)) >= size)
+			return bp;
+		*work += COMPACT_VISIT / 4;
+		if (*work >= budget) {
+			lower_cursor = nextPtr(bp);
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * moveDown - moves handle block bp into free block to, which lies below it,
+ * 		and frees bp's old block
+ */
+static inline void moveDown (address bp, address to)
+{
+	uint32_t size = sizeOf(header(bp));
+	to = carve (to, size);
+	memcpy (to, bp, size * WSIZE - 2 * sizeof(tag));
+	*header(to) |= HANDLE_BIT;
+	handle_table[*(uint32_t*)to].bp = to;
+	*header(bp) &= ~HANDLE_BIT;
+	releaseBlock (bp);
+}
+
+/*
+ * compact - mm_compact, with the heap lock held
+ */
+static int
+compact (uint32_t budget)
+{
+	uint64_t work = 0;
+	// Frees and merges below fix compact_cursor up as they go, so it is
+	// the cursor itself that moves through the heap
+	while (work < budget) {
+		address bp = compact_cursor;
+		if (bp == heap_top) {
+			trimWild (0);
+			compact_cursor = nextBlock (free_list_head);
+			lower_cursor = NULL;
+			return 1;
+		}
+		address next = nextBlock (bp);
+		work += COMPACT_VISIT;
+		if (!isAllocated(header(bp)) && next != heap_top && movable (next)) {
+			work += sizeOf(header(next)) * WSIZE;
+			// The free space may reach the end of the heap
+			retractWild (compact_cursor = slideDown (bp));
+		} else if (isAllocated(header(bp)) && movable (bp)) {
+			address to = findLower (sizeOf(header(bp)), bp, &work, budget);
+			if (to != NULL) {
+				work += sizeOf(header(bp)) * WSIZE;
+				moveDown (bp, to);
+			} else if (lower_cursor == NULL) {
+				compact_cursor = next;
+			}
+		} else {
+			compact_cursor = next;
+		}
+	}
+	return 0;
+}
+
+/*
+ * mm_compact - does about budget bytes of compaction work, sliding handle
+ * 		blocks toward the start of the heap, and picks up where the last call
+ * 		left off. Returns 1 when this call finished a pass over the heap, in
+ * 		which case the wilderness has been trimmed back, and 0 otherwise.
+ */
+int
+mm_compact (uint32_t budget)
+{
+	lockHeap ();
+	int done = compact (budget);
+	unlockHeap ();
+	return done;
+}
+#endif
+
+/*
+ * mm_get_stats - copies out the counters collected since mm_init. They are
+ * 		only kept when mm.c is built with -DMM_STATS and read as zero otherwise.
+ */
+void
+mm_get_stats (mm_stats_t *out)
+{
+#if defined(MM_STATS)
+	lockHeap ();
+	*out = stats;
+	unlockHeap ();
+#else
+	memset (out, 0, sizeof(*out));
+#endif
+}
+
+/*
+ * checkHeap - mm_check, with the heap lock held
+ */
+static int checkHeap(void)
 {
 	// Heap head isn't set properly
 	if (free_list_head == NULL)
@@ -280,11 +1923,62 @@ int mm_check(void)
 		// The two in a row are not allocated, you missed a coalesce
 		if (!isAllocated(header(blockptr)) && !isAllocated(nextHeader(blockptr)))
 			return 0;
+		// Only free blocks are purged, and both tags say so
+		if ((*header(blockptr) & PURGED_BIT) != (*footer(blockptr) & PURGED_BIT) ||
+		    ((*header(blockptr) & PURGED_BIT) && isAllocated(header(blockptr))))
+			return 0;
 	}
 	// Checks to see if all the items on the free list are actually free.
-	for(address ptr = *nextPtr(free_list_head); ptr != free_list_head; ptr = *nextPtr(ptr)) {
+	for(address ptr = nextPtr(free_list_head); ptr != free_list_head; ptr = nextPtr(ptr)) {
 		if (isAllocated(header(ptr)))
 			return 0;
 	}
+#if defined(MM_SIDE_TABLE)
+	// Descriptors know their blocks' sizes, and all but the head's in use
+	// are on the list
+	uint32_t listed = 1;
+	for(address ptr = nextPtr(free_list_head); ptr != free_list_head; ptr = nextPtr(ptr), listed++) {
+		if (descOf(ptr)->size != sizeOf(header(ptr)))
+			return 0;
+	}
+	if (listed != side_count)
+		return 0;
+#endif
+#if defined(MM_HANDLES)
+	// Every live handle's block is an allocated handle block naming it
+	for (uint32_t h = 1; h < handle_next; h++) {
+		address bp = handle_table[h].bp;
+		if (bp != NULL && (!isAllocated(header(bp)) || !(*header(bp) & HANDLE_BIT) || *(uint32_t*)bp != h))
+			return 0;
+	}
+#endif
+#if defined(MM_SMALL_SPANS)
+	// Queued spans are allocated blocks, mapped to themselves, and every
+	// free object lies on an object boundary inside the span
+	for (uint32_t c = 0; c < SPAN_CLASSES; c++) {
+		for (spanDesc* s = span_queues[c]; s != NULL; s = s->next) {
+			if (!isAllocated(header((address)s)) || s->full || s->sizeClass != c)
+				return 0;
+			if (mapLookup ((address)s + (s->pages - 1) * SPAN_PAGE) != ((uintptr_t)s | c))
+				return 0;
+			uint32_t onList = 0;
+			for (address bp = s->free; bp != NULL; bp = *(address*)bp, onList++) {
+				uintptr_t off = (uintptr_t)(bp - spanObjects (s));
+				if (off % s->objSize != 0 || off / s->objSize >= s->capacity)
+					return 0;
+			}
+			if (s->used + onList != s->capacity)
+				return 0;
+		}
+	}
+#endif
 	return 1;
 }
+
+int mm_check(void)
+{
+	lockHeap ();
+	int ok = checkHeap ();
+	unlockHeap ();
+	return ok;
+}
@@ -5,3 +5,120 @@ extern int mm_init (void);
 extern void *mm_malloc (uint32_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, uint32_t size);
+extern void *mm_calloc (uint32_t nmemb, uint32_t size);
+
+#define MM_CACHELINE 64
+
+extern void *mm_memalign (uint32_t alignment, uint32_t size);
+extern void *mm_malloc_cacheline (uint32_t size);
+
+/* Counters of one lock, or summed over a set of locks, kept when the
+   thread safe parts are built with -DMM_LOCK_STATS */
+typedef struct
+{
+  uint64_t acquires;        /* times it was taken */
+  uint64_t contended;       /* of those, times the taker had to wait */
+  uint64_t wait_cycles;     /* cycles spent waiting in all */
+  uint64_t max_wait_cycles; /* longest wait */
+} mm_lock_stats_t;
+
+/* Counters kept by the allocator when it is built with -DMM_STATS */
+typedef struct
+{
+  uint64_t fit_calls;  /* free block searches in find_fit */
+  uint64_t fit_cycles; /* cycles spent in those searches */
+  uint64_t realloc_copied;   /* payload bytes realloc copied */
+  uint64_t realloc_remapped; /* payload bytes realloc moved by remapping pages */
+  uint64_t map_bytes;   /* memory taken by the page map of small spans */
+  uint64_t map_lookups; /* page map lookups */
+  uint64_t map_cycles;  /* cycles spent in those lookups */
+  mm_lock_stats_t heap_lock;  /* heap lock of a shared engine (MM_TLSF_SHARED) */
+  mm_lock_stats_t list_locks; /* its list locks */
+} mm_stats_t;
+
+extern void mm_get_stats (mm_stats_t *stats);
+
+/* Handles (mm.c built with -DMM_HANDLES): blocks the allocator may move while
+   they aren't locked, and an incremental compactor that moves them */
+typedef uint32_t mm_handle_t;
+
+extern mm_handle_t mm_halloc (uint32_t size);
+extern void *mm_hlock (mm_handle_t h);
+extern void mm_hunlock (mm_handle_t h);
+extern void mm_hfree (mm_handle_t h);
+extern int mm_compact (uint32_t budget);
+
+/* Background upkeep (mm.c built with -DMM_BACKGROUND): how often, in
+   microseconds, the maintenance thread merges deferred frees, trims and
+   purges, 0 for never, and the smallest free block it purges, 0 for none.
+   While paused the thread stays out of the heap. */
+extern void mm_background_tune (uint32_t interval_us, uint32_t purge_min);
+extern void mm_background_pause (int pause);
+
+/* Arenas (mm_arena.c): bump allocation out of chunks taken from mm_malloc,
+   released all at once or back to a mark */
+typedef struct mm_arena mm_arena_t;
+typedef struct
+{
+  void *chunk;   /* chunk the cursor was in */
+  uint32_t used; /* bytes of that chunk handed out */
+} mm_arena_mark_t;
+
+extern mm_arena_t *mm_arena_create (uint32_t chunk_size);
+extern void *mm_arena_alloc (mm_arena_t *arena, uint32_t size);
+extern mm_arena_mark_t mm_arena_mark (mm_arena_t *arena);
+extern void mm_arena_release (mm_arena_t *arena, mm_arena_mark_t mark);
+extern void mm_arena_reset (mm_arena_t *arena);
+extern void mm_arena_destroy (mm_arena_t *arena);
+
+/* Pools (mm_pool.c): objects of one size kept on free lists in slabs cut
+   from regions taken from mm_malloc. A pool made with mm_pool_create_cache keeps its objects
+   constructed while they are free, and its empty slabs until mm_pool_reap. */
+typedef struct mm_pool mm_pool_t;
+typedef void (*mm_pool_ctor_t) (void *obj, void *arg);
+
+extern mm_pool_t *mm_pool_create (uint32_t object_size, uint32_t alignment);
+extern mm_pool_t *mm_pool_create_cache (uint32_t object_size, uint32_t alignment,
+                                        mm_pool_ctor_t ctor, mm_pool_ctor_t dtor,
+                                        void *arg);
+extern void *mm_pool_alloc (mm_pool_t *pool);
+extern void mm_pool_free (mm_pool_t *pool, void *ptr);
+extern void mm_pool_reap (mm_pool_t *pool);
+extern void mm_pool_destroy (mm_pool_t *pool);
+
+/* Per-CPU caches (mm_percpu.c): a thread safe front end that caches small
+   objects per CPU, and one that caches them per thread, for comparison.
+   Objects are freed with the size they were allocated with. */
+extern void mm_cpu_init (void);
+extern void *mm_cpu_malloc (uint32_t size);
+extern void mm_cpu_free (void *ptr, uint32_t size);
+extern void *mm_thread_malloc (uint32_t size);
+extern void mm_thread_free (void *ptr, uint32_t size);
+extern uint64_t mm_cpu_heap_bytes (void);
+extern int mm_cpu_rseq (void);
+
+/* Lock counters of the front ends, kept with -DMM_LOCK_STATS */
+typedef struct
+{
+  mm_lock_stats_t heap;   /* the lock every call into the engine is made under */
+  mm_lock_stats_t cpus;   /* per-CPU cache locks, taken when rseq isn't used */
+  mm_lock_stats_t depots; /* magazine depot locks */
+} mm_cpu_lock_stats_t;
+
+extern void mm_cpu_get_lock_stats (mm_cpu_lock_stats_t *stats);
+
+/* Magazines (mm_percpu.c): per-thread magazines of objects traded whole with
+   a depot per size class */
+typedef struct
+{
+  uint64_t gets;        /* empty magazines offered to a depot for full ones */
+  uint64_t get_hits;    /* of those, traded */
+  uint64_t puts;        /* full magazines offered to a depot for empty ones */
+  uint64_t put_hits;    /* of those, traded */
+  uint64_t locks;       /* times a depot lock was taken */
+  uint64_t hold_cycles; /* cycles the depot locks were held (ns off x86) */
+} mm_depot_stats_t;
+
+extern void *mm_mag_malloc (uint32_t size);
+extern void mm_mag_free (void *ptr, uint32_t size);
+extern void mm_mag_get_stats (mm_depot_stats_t *stats);
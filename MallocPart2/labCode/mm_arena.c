@@ -0,0 +1,159 @@
+/*
+ * mm_arena.c - arenas on top of whichever allocator engine is linked in
+ *
+ * An arena hands out memory by bumping a cursor through chunks it takes
+ * from mm_malloc, and never frees anything on its own. Everything it handed
+ * out goes at once: mm_arena_reset rewinds the cursor to the first chunk,
+ * and mm_arena_release rewinds it to a mark taken earlier, so scopes can
+ * nest. Both are O(1). The chunks past the cursor are kept for the arena to
+ * bump through again and only go back to mm_free in mm_arena_destroy.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+
+#define ALIGNMENT 16
+// Chunk payload size used when mm_arena_create is passed 0
+#define DEFAULT_CHUNK 4096
+
+typedef uint8_t byte;
+typedef byte* address;
+
+typedef struct chunk {
+	struct chunk* next;  // the chunk bumped through after this one
+	uint32_t size;       // bytes of payload after the header
+} chunk;
+
+struct mm_arena {
+	chunk* first;
+	chunk* current;
+	uint32_t used;       // bytes of current's payload handed out
+	uint32_t chunkSize;
+};
+
+// Largest request whose rounding and chunk header still fit in 32 bits
+#define MAX_SIZE (UINT32_MAX - ALIGNMENT - (uint32_t)sizeof(chunk))
+
+static inline uint32_t alignUp (uint32_t bytes) {
+	return (bytes + ALIGNMENT - 1) & ~(uint32_t)(ALIGNMENT - 1);
+}
+
+static inline address payload (chunk* c) {
+	return (address)c + alignUp ((uint32_t)sizeof(chunk));
+}
+
+static inline chunk* newChunk (uint32_t size, chunk* next) {
+	chunk* c = mm_malloc (alignUp ((uint32_t)sizeof(chunk)) + size);
+	if (c != NULL) {
+		c->next = next;
+		c->size = size;
+	}
+	return c;
+}
+
+/*
+ * mm_arena_create - makes an empty arena that takes chunks of chunk_size
+ * 		bytes from mm_malloc, or DEFAULT_CHUNK when chunk_size is 0
+ */
+mm_arena_t*
+mm_arena_create (uint32_t chunk_size)
+{
+	if (chunk_size > MAX_SIZE) {
+		return NULL;
+	}
+	mm_arena_t* arena = mm_malloc (sizeof(mm_arena_t));
+	if (arena == NULL) {
+		return NULL;
+	}
+	arena->chunkSize = alignUp (chunk_size ? chunk_size : DEFAULT_CHUNK);
+	arena->first = arena->current = newChunk (arena->chunkSize, NULL);
+	arena->used = 0;
+	if (arena->first == NULL) {
+		mm_free (arena);
+		return NULL;
+	}
+	return arena;
+}
+
+/*
+ * mm_arena_alloc - size bytes from the arena, 16 byte aligned, or NULL when
+ * 		size is too big to take a chunk for. When the current chunk is full
+ * 		the arena moves on to a kept chunk if that one is big enough, and
+ * 		takes a new chunk from mm_malloc otherwise.
+ */
+void*
+mm_arena_alloc (mm_arena_t *arena, uint32_t size)
+{
+	if (size == 0 || size > MAX_SIZE) {
+		return NULL;
+	}
+	size = alignUp (size);
+	chunk* c = arena->current;
+	if (c->size - arena->used < size) {
+		if (c->next == NULL || c->next->size < size) {
+			chunk* fresh = newChunk (size > arena->chunkSize ? size : arena->chunkSize, c->next);
+			if (fresh == NULL) {
+				return NULL;
+			}
+			c->next = fresh;
+		}
+		c = arena->current = c->next;
+		arena->used = 0;
+	}
+	void* bp = payload (c) + arena->used;
+	arena->used += size;
+	return bp;
+}
+
+/*
+ * mm_arena_mark - where the arena's cursor is now, for mm_arena_release
+ */
+mm_arena_mark_t
+mm_arena_mark (mm_arena_t *arena)
+{
+	mm_arena_mark_t mark = { arena->current, arena->used };
+	return mark;
+}
+
+/*
+ * mm_arena_release - frees everything allocated since mark was taken. Marks
+ * 		taken after it are no longer valid.
+ */
+void
+mm_arena_release (mm_arena_t *arena, mm_arena_mark_t mark)
+{
+	arena->current = mark.chunk;
+	arena->used = mark.used;
+}
+
+/*
+ * mm_arena_reset - frees everything allocated from the arena, keeping its
+ * 		chunks for reuse
+ */
+void
+mm_arena_reset (mm_arena_t *arena)
+{
+	arena->current = arena->first;
+	arena->used = 0;
+}
+
+/*
+ * mm_arena_destroy - gives the arena's chunks and the arena itself back to
+ * 		mm_free
+ */
+void
+mm_arena_destroy (mm_arena_t *arena)
+{
+	if (arena == NULL) {
+		return;
+	}
+	chunk* c = arena->first;
+	while (c != NULL) {
+		chunk* next = c->next;
+		mm_free (c);
+		c = next;
+	}
+	mm_free (arena);
+}
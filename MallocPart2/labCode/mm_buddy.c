@@ -0,0 +1,334 @@
+/*
+ * mm_buddy.c - binary buddy engine (build with -DMALLOC_LAB_BUDDY)
+ *
+ * Every block is a power of two of at least 16 bytes, and a block of order k
+ * (2^k bytes) starts at a multiple of 2^k from the start of the heap. Its
+ * buddy is the block whose offset differs only in bit k, so coalescing is
+ * address arithmetic. Blocks carry no tags at all: the order of each
+ * allocated block is kept in a side table with a byte per 16 byte granule,
+ * and one bitmap per order marks which blocks of that order are free. The
+ * free blocks of each order are also threaded on a list through their
+ * payloads so malloc can find one without scanning a bitmap.
+ *
+ * The heap grows on demand. To append a block of order k, the end of the heap
+ * is first padded up to a multiple of 2^k with free blocks of the smaller
+ * orders that fit there, which later allocations can use.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+
+#define MIN_ORDER 4
+#define MAX_ORDER 31
+// The largest request a block can hold; extend_heap takes orders below
+// MAX_ORDER, and orderOf is only defined for sizes up to 1u << 31
+#define MAX_SIZE (1u << (MAX_ORDER - 1))
+#define GRANULES (MAX_HEAP >> MIN_ORDER)
+
+typedef uint8_t byte;
+typedef byte* address;
+
+// Order of the allocated block starting at each granule
+static uint8_t orders[GRANULES];
+// One free bit per block of each order, all orders packed into one array
+static uint64_t free_bits[2 * GRANULES / 64 + MAX_ORDER];
+static uint64_t* free_map[MAX_ORDER + 1];
+// Head of the free list of each order, and a bit per non-empty list
+static address free_lists[MAX_ORDER + 1];
+static uint32_t avail;
+
+static address heap_base;
+// Bytes of the heap covered by blocks; the heap never extends past this
+static uintptr_t heap_end;
+
+#if defined(MM_STATS)
+static mm_stats_t stats;
+#endif
+
+static inline uintptr_t offsetOf (address bp) {
+	return (uintptr_t)(bp - heap_base);
+}
+
+static inline address* nextPtr (address base) {
+	return (address*)base;
+}
+
+static inline address* prevPtr (address base) {
+	return (address*)base + 1;
+}
+
+static inline bool isFree (uintptr_t off, uint32_t order) {
+	uintptr_t i = off >> order;
+	return (free_map[order][i / 64] >> (i % 64)) & 1;
+}
+
+static inline void setFree (uintptr_t off, uint32_t order, bool isFreeNow) {
+	uintptr_t i = off >> order;
+	uint64_t bit = (uint64_t)1 << (i % 64);
+	if (isFreeNow)
+		free_map[order][i / 64] |= bit;
+	else
+		free_map[order][i / 64] &= ~bit;
+}
+
+/* Adds a free block of the given order to its list and bitmap */
+static inline void pushBlock (address bp, uint32_t order) {
+	address head = free_lists[order];
+	*nextPtr(bp) = head;
+	*prevPtr(bp) = NULL;
+	if (head != NULL)
+		*prevPtr(head) = bp;
+	free_lists[order] = bp;
+	avail |= 1u << order;
+	setFree (offsetOf(bp), order, true);
+}
+
+/* Takes a free block of the given order off its list and bitmap */
+static inline void unlinkBlock (address bp, uint32_t order) {
+	address next = *nextPtr(bp);
+	address prev = *prevPtr(bp);
+	if (next != NULL)
+		*prevPtr(next) = prev;
+	if (prev != NULL)
+		*nextPtr(prev) = next;
+	else if ((free_lists[order] = next) == NULL)
+		avail &= ~(1u << order);
+	setFree (offsetOf(bp), order, false);
+}
+
+/*
+ * freeBlock - frees a block of the given order, merging it with its buddy
+ * 		for as long as the buddy is free and whole
+ */
+static inline void freeBlock (address bp, uint32_t order) {
+	uintptr_t off = offsetOf(bp);
+	while (order < MAX_ORDER) {
+		uintptr_t buddy = off ^ ((uintptr_t)1 << order);
+		if (buddy + ((uintptr_t)1 << order) > heap_end || !isFree (buddy, order))
+			break;
+		unlinkBlock (heap_base + buddy, order);
+		off &= ~((uintptr_t)1 << order);
+		order++;
+	}
+	pushBlock (heap_base + off, order);
+}
+
+/*
+ * orderOf - the smallest order whose blocks hold bytes
+ */
+static inline uint32_t orderOf (uint32_t bytes) {
+	if (bytes <= (1u << MIN_ORDER))
+		return MIN_ORDER;
+	return 32 - (uint32_t)__builtin_clz (bytes - 1);
+}
+
+/*
+ * extend_heap - appends a free block of the given order to the heap, padding
+ * 		the end of the heap up to its alignment with smaller free blocks
+ */
+static inline bool extend_heap (uint32_t order) {
+	uintptr_t size = (uintptr_t)1 << order;
+	uintptr_t pad = (size - heap_end % size) % size;
+	if (order >= MAX_ORDER || heap_end + pad + size > MAX_HEAP)
+		return false;
+	if (mem_sbrk ((int)(pad + size)) == (void *)-1)
+		return false;
+	while (heap_end % size != 0) {
+		uint32_t low = (uint32_t)__builtin_ctzll (heap_end);
+		heap_end += (uintptr_t)1 << low;
+		freeBlock (heap_base + heap_end - ((uintptr_t)1 << low), low);
+	}
+	heap_end += size;
+	pushBlock (heap_base + heap_end - size, order);
+	return true;
+}
+
+/*
+ * takeBlock - removes a free block of exactly the given order, splitting a
+ * 		larger one or growing the heap if needed. Returns NULL when out of
+ * 		memory.
+ */
+static inline address takeBlock (uint32_t order) {
+#if defined(MM_STATS)
+	uint64_t start = __rdtsc ();
+#endif
+	uint32_t larger = avail & (~0u << order);
+#if defined(MM_STATS)
+	stats.fit_calls++;
+	stats.fit_cycles += __rdtsc () - start;
+#endif
+	if (larger == 0) {
+		if (!extend_heap (order))
+			return NULL;
+		larger = avail & (~0u << order);
+	}
+	uint32_t from = (uint32_t)__builtin_ctz (larger);
+	address bp = free_lists[from];
+	unlinkBlock (bp, from);
+	// Hand the upper halves back until the block is the right size
+	while (from > order) {
+		from--;
+		pushBlock (bp + ((uintptr_t)1 << from), from);
+	}
+	orders[offsetOf(bp) >> MIN_ORDER] = (uint8_t)order;
+	return bp;
+}
+
+int
+mm_init (void)
+{
+	memset (free_lists, 0, sizeof(free_lists));
+	avail = 0;
+	heap_end = 0;
+	heap_base = mem_sbrk (0);
+	if (heap_base == (void *)-1)
+		return -1;
+	size_t words = 0;
+	for (uint32_t order = MIN_ORDER; order <= MAX_ORDER; order++) {
+		free_map[order] = free_bits + words;
+		words += ((size_t)GRANULES >> (order - MIN_ORDER)) / 64 + 1;
+	}
+	memset (free_bits, 0, sizeof(free_bits));
+#if defined(MM_STATS)
+	memset (&stats, 0, sizeof(stats));
+#endif
+	return 0;
+}
+
+void*
+mm_malloc (uint32_t size)
+{
+	if (size == 0 || size > MAX_SIZE) {
+		return NULL;
+	}
+	return takeBlock (orderOf (size));
+}
+
+void*
+mm_memalign (uint32_t alignment, uint32_t size)
+{
+	// Blocks are aligned to their own size relative to the heap, whose
+	// start is only known to be page aligned
+	if (size == 0 || size > MAX_SIZE || (alignment & (alignment - 1)) != 0 || alignment > mem_pagesize ()) {
+		return NULL;
+	}
+	uint32_t order = orderOf (size);
+	if ((1u << order) < alignment)
+		order = orderOf (alignment);
+	return takeBlock (order);
+}
+
+void*
+mm_malloc_cacheline (uint32_t size)
+{
+	return mm_memalign (MM_CACHELINE, size);
+}
+
+void
+mm_free (void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	freeBlock ((address)ptr, orders[offsetOf((address)ptr) >> MIN_ORDER]);
+}
+
+void*
+mm_realloc (void *ptr, uint32_t size)
+{
+	if (ptr == NULL) {
+		return mm_malloc (size);
+	}
+	if (size == 0) {
+		mm_free (ptr);
+		return NULL;
+	}
+	if (size > MAX_SIZE) {
+		return NULL;
+	}
+	address bp = (address)ptr;
+	uintptr_t off = offsetOf(bp);
+	uint32_t order = orders[off >> MIN_ORDER];
+	uint32_t want = orderOf (size);
+	if (want <= order) {
+		// Give back upper halves the smaller size no longer needs
+		while (order > want) {
+			order--;
+			freeBlock (bp + ((uintptr_t)1 << order), order);
+		}
+		orders[off >> MIN_ORDER] = (uint8_t)order;
+		return ptr;
+	}
+	// Grow in place while bp is the lower buddy and each upper buddy is free
+	uint32_t k = order;
+	while (k < want && (off & ((uintptr_t)1 << k)) == 0 &&
+	       off + ((uintptr_t)2 << k) <= heap_end && isFree (off + ((uintptr_t)1 << k), k))
+		k++;
+	if (k == want) {
+		for (k = order; k < want; k++)
+			unlinkBlock (bp + ((uintptr_t)1 << k), k);
+		orders[off >> MIN_ORDER] = (uint8_t)want;
+		return ptr;
+	}
+	address newPtr = takeBlock (want);
+	if (newPtr == NULL) {
+		return NULL;
+	}
+	memcpy (newPtr, ptr, (size_t)1 << order);
+#if defined(MM_STATS)
+	stats.realloc_copied += (uint64_t)1 << order;
+#endif
+	freeBlock (bp, order);
+	return newPtr;
+}
+
+void
+mm_get_stats (mm_stats_t *out)
+{
+#if defined(MM_STATS)
+	*out = stats;
+#else
+	memset (out, 0, sizeof(*out));
+#endif
+}
+
+int mm_check(void)
+{
+	// Every listed block is marked free at its order, lies inside the heap
+	// and is aligned to its size, and no two free buddies were left unmerged
+	uintptr_t listed = 0;
+	for (uint32_t order = MIN_ORDER; order <= MAX_ORDER; order++) {
+		if ((free_lists[order] != NULL) != (bool)(avail & (1u << order)))
+			return 0;
+		for (address bp = free_lists[order]; bp != NULL; bp = *nextPtr(bp)) {
+			uintptr_t off = offsetOf(bp);
+			uintptr_t buddy = off ^ ((uintptr_t)1 << order);
+			if (off % ((uintptr_t)1 << order) != 0 || off + ((uintptr_t)1 << order) > heap_end)
+				return 0;
+			if (!isFree (off, order))
+				return 0;
+			if (buddy + ((uintptr_t)1 << order) <= heap_end && isFree (buddy, order))
+				return 0;
+			listed++;
+		}
+	}
+	// ...and nothing is marked free that isn't listed
+	uintptr_t marked = 0;
+	for (uint32_t order = MIN_ORDER; order <= MAX_ORDER; order++) {
+		for (uintptr_t i = 0; i <= (heap_end >> order) / 64; i++)
+			marked += (uintptr_t)__builtin_popcountll (free_map[order][i]);
+	}
+	return listed == marked;
+}
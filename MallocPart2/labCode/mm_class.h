@@ -0,0 +1,34 @@
+/*
+ * mm_class.h - the size classes of the page engine, mm.c's small spans and
+ * the per-CPU caches
+ *
+ * Classes step by 16 bytes up to 64, then by a quarter of a power of two,
+ * which gives MM_CLASSES classes of objects up to MM_CLASS_MAX bytes.
+ */
+
+#ifndef MALLOC_LAB_CLASS_H_
+#define MALLOC_LAB_CLASS_H_
+
+#include <stdint.h>
+
+#define MM_CLASS_MAX 1024
+#define MM_CLASSES 20
+
+/* classOf - the smallest class with objects of at least size bytes */
+static inline uint32_t classOf (uint32_t size) {
+	if (size <= 64)
+		return size <= 16 ? 0 : (size - 1) / 16;
+	uint32_t w = size - 1;
+	uint32_t b = 31 - (uint32_t)__builtin_clz (w);
+	return 4 + (b - 6) * 4 + ((w >> (b - 2)) & 3);
+}
+
+/* classSize - the size of the objects of class c */
+static inline uint32_t classSize (uint32_t c) {
+	if (c < 4)
+		return (c + 1) * 16;
+	uint32_t b = 6 + (c - 4) / 4;
+	return (5 + (c - 4) % 4) << (b - 2);
+}
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * mm_lock.h - lock wrappers for the thread safe parts of the allocator
+ *
+ * Built with -DMM_LOCK_STATS, each wrapper first tries the lock and only
+ * times the wait with holdClock when the try fails, then counts the acquire
+ * in the lock's mm_lock_stats_t. Counters of a mutex or a write lock are
+ * updated while it is held; those of a read lock atomically, since readers
+ * hold it together. Built without it, the wrappers are the plain pthread
+ * calls.
+ */
+
+#ifndef MALLOC_LAB_LOCK_H_
+#define MALLOC_LAB_LOCK_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* mm_lock_stats_t comes from mm.h, which has to be included first */
+
+/* holdClock - cycles where there is a cycle counter, nanoseconds elsewhere */
+static inline uint64_t holdClock (void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc ();
+#else
+	struct timespec t;
+	clock_gettime (CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000u + (uint64_t)t.tv_nsec;
+#endif
+}
+
+/* Adds the counters of one lock to a sum over several */
+static inline void addLockStats (mm_lock_stats_t* sum, const mm_lock_stats_t* s) {
+	sum->acquires += s->acquires;
+	sum->contended += s->contended;
+	sum->wait_cycles += s->wait_cycles;
+	if (s->max_wait_cycles > sum->max_wait_cycles)
+		sum->max_wait_cycles = s->max_wait_cycles;
+}
+
+#if defined(MM_LOCK_STATS)
+static inline void countWait (mm_lock_stats_t* s, uint64_t wait) {
+	s->contended++;
+	s->wait_cycles += wait;
+	if (wait > s->max_wait_cycles)
+		s->max_wait_cycles = wait;
+}
+#endif
+
+static inline void lockMutex (pthread_mutex_t* m, mm_lock_stats_t* s) {
+#if defined(MM_LOCK_STATS)
+	if (pthread_mutex_trylock (m) != 0) {
+		uint64_t start = holdClock ();
+		pthread_mutex_lock (m);
+		countWait (s, holdClock () - start);
+	}
+	s->acquires++;
+#else
+	(void)s;
+	pthread_mutex_lock (m);
+#endif
+}
+
+static inline void lockWrite (pthread_rwlock_t* l, mm_lock_stats_t* s) {
+#if defined(MM_LOCK_STATS)
+	if (pthread_rwlock_trywrlock (l) != 0) {
+		uint64_t start = holdClock ();
+		pthread_rwlock_wrlock (l);
+		countWait (s, holdClock () - start);
+	}
+	s->acquires++;
+#else
+	(void)s;
+	pthread_rwlock_wrlock (l);
+#endif
+}
+
+static inline void lockRead (pthread_rwlock_t* l, mm_lock_stats_t* s) {
+#if defined(MM_LOCK_STATS)
+	if (pthread_rwlock_tryrdlock (l) != 0) {
+		uint64_t start = holdClock ();
+		pthread_rwlock_rdlock (l);
+		uint64_t wait = holdClock () - start;
+		__atomic_fetch_add (&s->contended, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add (&s->wait_cycles, wait, __ATOMIC_RELAXED);
+		uint64_t max = __atomic_load_n (&s->max_wait_cycles, __ATOMIC_RELAXED);
+		while (wait > max &&
+		       !__atomic_compare_exchange_n (&s->max_wait_cycles, &max, wait, true,
+		                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+	__atomic_fetch_add (&s->acquires, 1, __ATOMIC_RELAXED);
+#else
+	(void)s;
+	pthread_rwlock_rdlock (l);
+#endif
+}
+
+#endif
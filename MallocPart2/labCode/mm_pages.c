@@ -0,0 +1,638 @@
+/*
+ * mm_pages.c - size-class page engine (build with -DMALLOC_LAB_PAGES)
+ *
+ * The heap is cut into 4 KiB pages. Small requests are rounded up to one of
+ * CLASS_COUNT size classes, and a run of one or more pages (a span) is handed
+ * to a single class and filled with blocks of exactly that size. Blocks carry
+ * no header: a page table outside the heap, indexed by page number, says
+ * which span a pointer is in and what size its blocks are.
+ *
+ * Each small span keeps three short free lists of its own. malloc pops from
+ * free; free pushes onto local_free, which is only moved over to free once
+ * free runs dry; and thread_free takes frees made by any thread other than
+ * the one that called mm_init, which owns the heap, with an atomic push. The
+ * owner collects thread_free at the same time as local_free. Keeping the
+ * lists per span keeps them short and keeps malloc popping from a span it
+ * has just been using.
+ *
+ * Requests over SMALL_MAX get a span of whole pages to themselves. Free spans
+ * are coalesced with their neighbours and kept in lists binned by length.
+ */
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "config.h"
+#include "memlib.h"
+#include "mm.h"
+#include "mm_class.h"
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1u << PAGE_SHIFT)
+#define MAX_PAGES (MAX_HEAP >> PAGE_SHIFT)
+// Classes step by 16 bytes up to 64, then by a quarter of a power of two
+#define SMALL_MAX MM_CLASS_MAX
+#define CLASS_COUNT MM_CLASSES
+// A small span may waste at most 1/SPAN_WASTE of itself at its end
+#define SPAN_WASTE 8
+#define MAX_SMALL_SPAN 16
+// Free spans of up to SPAN_BINS-1 pages get a list per length
+#define SPAN_BINS 32
+#define REMAP_MIN (1 << 18)
+
+typedef uint8_t byte;
+typedef byte* address;
+
+enum { SPAN_FREE, SPAN_SMALL, SPAN_LARGE };
+
+typedef struct page {
+	address free;                  // blocks malloc can pop
+	address local_free;            // blocks freed by the owner
+	_Atomic(address) thread_free;  // blocks freed by other threads
+	struct page* next;             // class queue, full list or span bin
+	struct page* prev;
+	uint32_t start;                // first page of the span this page is in
+	uint32_t count;                // pages in the span
+	uint32_t blockSize;            // bytes per block in a small span
+	uint16_t used;                 // blocks out, counting uncollected thread frees
+	uint16_t capacity;             // blocks carved out of the span so far
+	uint16_t reserved;             // blocks the span can hold
+	uint8_t kind;
+	uint8_t sizeClass;
+	bool full;
+} page_t;
+
+static page_t pages[MAX_PAGES];
+static uint32_t heap_pages;
+static address heap_base;
+
+// Spans of each class with room left, and those without
+static page_t* queues[CLASS_COUNT];
+static page_t* full_pages[CLASS_COUNT];
+static page_t* span_bins[SPAN_BINS];
+
+// Frees of large spans made by other threads, and a count of all such
+// frees the owner has yet to collect
+static _Atomic(address) deferred_large;
+static atomic_uint thread_frees;
+static _Thread_local char thread_tag;
+static const char* heap_owner;
+
+#if defined(MM_STATS)
+static mm_stats_t stats;
+#endif
+
+static inline address* nextFree (address bp) {
+	return (address*)bp;
+}
+
+static inline address spanStart (page_t* p) {
+	return heap_base + ((size_t)(p - pages) << PAGE_SHIFT);
+}
+
+static inline page_t* pageOf (address bp) {
+	return &pages[pages[(size_t)(bp - heap_base) >> PAGE_SHIFT].start];
+}
+
+static inline uint32_t pagesFor (size_t bytes) {
+	return (uint32_t)((bytes + PAGE_SIZE - 1) >> PAGE_SHIFT);
+}
+
+/* Pages in a span for blocks of the given size, wasting little at its end */
+static inline uint32_t smallSpanPages (uint32_t blockSize) {
+	uint32_t n = pagesFor (blockSize);
+	while (n < MAX_SMALL_SPAN && (n * PAGE_SIZE) % blockSize * SPAN_WASTE > n * PAGE_SIZE)
+		n++;
+	return n;
+}
+
+static inline void listPush (page_t** head, page_t* p) {
+	p->prev = NULL;
+	p->next = *head;
+	if (*head != NULL)
+		(*head)->prev = p;
+	*head = p;
+}
+
+static inline void listRemove (page_t** head, page_t* p) {
+	if (p->next != NULL)
+		p->next->prev = p->prev;
+	if (p->prev != NULL)
+		p->prev->next = p->next;
+	else
+		*head = p->next;
+}
+
+static inline uint32_t binOf (uint32_t count) {
+	return count < SPAN_BINS ? count : 0;
+}
+
+/* Marks pages [first, first+count) as one span of the given kind */
+static inline page_t* setSpan (uint32_t first, uint32_t count, uint8_t kind) {
+	page_t* p = &pages[first];
+	page_t* last = &pages[first + count - 1];
+	p->kind = last->kind = kind;
+	p->count = last->count = count;
+	p->start = last->start = first;
+	return p;
+}
+
+static inline void insertSpan (uint32_t first, uint32_t count) {
+	listPush (&span_bins[binOf (count)], setSpan (first, count, SPAN_FREE));
+}
+
+/*
+ * freeSpan - returns a span to the free bins, merging it with free spans on
+ * 		either side
+ */
+static inline void freeSpan (uint32_t first, uint32_t count) {
+	uint32_t end = first + count;
+	if (end < heap_pages && pages[end].kind == SPAN_FREE) {
+		count += pages[end].count;
+		listRemove (&span_bins[binOf (pages[end].count)], &pages[end]);
+	}
+	if (first > 0 && pages[first - 1].kind == SPAN_FREE) {
+		page_t* prev = &pages[pages[first - 1].start];
+		listRemove (&span_bins[binOf (prev->count)], prev);
+		count += prev->count;
+		first = prev->start;
+	}
+	insertSpan (first, count);
+}
+
+/* Splits a span, freeing all of it past its first count pages */
+static inline void trimSpan (page_t* p, uint32_t count, uint8_t kind) {
+	uint32_t first = (uint32_t)(p - pages);
+	uint32_t rest = p->count - count;
+	setSpan (first, count, kind);
+	if (rest > 0)
+		freeSpan (first + count, rest);
+}
+
+/*
+ * allocSpan - takes a span of exactly count pages from the free bins,
+ * 		growing the heap when no free span is long enough. Returns NULL
+ * 		when out of memory.
+ */
+static page_t* allocSpan (uint32_t count, uint8_t kind) {
+#if defined(MM_STATS)
+	uint64_t start = __rdtsc ();
+	stats.fit_calls++;
+#endif
+	page_t* p = NULL;
+	for (uint32_t bin = count; bin < SPAN_BINS && p == NULL; bin++)
+		p = span_bins[bin];
+	if (p == NULL) {
+		for (page_t* q = span_bins[0]; q != NULL; q = q->next) {
+			if (q->count >= count) {
+				p = q;
+				break;
+			}
+		}
+	}
+#if defined(MM_STATS)
+	stats.fit_cycles += __rdtsc () - start;
+#endif
+	if (p != NULL) {
+		listRemove (&span_bins[binOf (p->count)], p);
+	} else {
+		// Grow the heap, reusing a free span at its end
+		uint32_t first = heap_pages;
+		if (first > 0 && pages[first - 1].kind == SPAN_FREE) {
+			first = pages[first - 1].start;
+			listRemove (&span_bins[binOf (pages[first].count)], &pages[first]);
+		}
+		uint32_t grow = first + count - heap_pages;
+		if ((size_t)first + count > MAX_PAGES ||
+		    mem_sbrk ((int)(grow * PAGE_SIZE)) == (void *)-1) {
+			if (first < heap_pages)
+				insertSpan (first, heap_pages - first);
+			return NULL;
+		}
+		heap_pages += grow;
+		p = setSpan (first, count, kind);
+	}
+	trimSpan (p, count, kind);
+	return p;
+}
+
+/*
+ * newSmallSpan - sets up an empty span for class c and puts it on the
+ * 		class queue
+ */
+static page_t* newSmallSpan (uint32_t c) {
+	uint32_t blockSize = classSize (c);
+	uint32_t count = smallSpanPages (blockSize);
+	page_t* p = allocSpan (count, SPAN_SMALL);
+	if (p == NULL)
+		return NULL;
+	uint32_t first = (uint32_t)(p - pages);
+	// Every page must find the span, since blocks can start in any of them
+	for (uint32_t i = first; i < first + count; i++)
+		pages[i].start = first;
+	p->free = p->local_free = NULL;
+	atomic_store_explicit (&p->thread_free, NULL, memory_order_relaxed);
+	p->blockSize = blockSize;
+	p->sizeClass = (uint8_t)c;
+	p->used = p->capacity = 0;
+	p->reserved = (uint16_t)(count * PAGE_SIZE / blockSize);
+	p->full = false;
+	listPush (&queues[c], p);
+	return p;
+}
+
+/*
+ * collect - moves blocks freed since the last collection onto the free
+ * 		list. Returns whether it found any.
+ */
+static inline bool collect (page_t* p) {
+	if (p->free == NULL) {
+		p->free = p->local_free;
+		p->local_free = NULL;
+	}
+	address list = atomic_exchange_explicit (&p->thread_free, NULL, memory_order_acquire);
+	if (list != NULL) {
+		uint32_t n = 1;
+		address tail = list;
+		while (*nextFree(tail) != NULL) {
+			tail = *nextFree(tail);
+			n++;
+		}
+		*nextFree(tail) = p->free;
+		p->free = list;
+		p->used = (uint16_t)(p->used - n);
+		atomic_fetch_sub_explicit (&thread_frees, n, memory_order_relaxed);
+	}
+	return p->free != NULL;
+}
+
+/*
+ * extend - carves up to a page worth of fresh blocks out of the span onto
+ * 		its free list, so a span is touched one page at a time
+ */
+static inline bool extend (page_t* p) {
+	if (p->capacity == p->reserved)
+		return false;
+	uint32_t n = PAGE_SIZE / p->blockSize;
+	if (n == 0)
+		n = 1;
+	if (n > (uint32_t)(p->reserved - p->capacity))
+		n = (uint32_t)(p->reserved - p->capacity);
+	address bp = spanStart (p) + (size_t)p->capacity * p->blockSize;
+	for (uint32_t i = 0; i + 1 < n; i++, bp += p->blockSize)
+		*nextFree(bp) = bp + p->blockSize;
+	*nextFree(bp) = p->free;
+	p->free = spanStart (p) + (size_t)p->capacity * p->blockSize;
+	p->capacity = (uint16_t)(p->capacity + n);
+	return true;
+}
+
+/*
+ * retire - gives an empty span back to the free bins, unless it is the
+ * 		only span its class has left
+ */
+static inline void retire (page_t* p) {
+	page_t** queue = &queues[p->sizeClass];
+	if (*queue == p && p->next == NULL)
+		return;
+	listRemove (queue, p);
+	freeSpan ((uint32_t)(p - pages), p->count);
+}
+
+/*
+ * collectFull - collects other threads' frees from full spans of class c,
+ * 		retiring those that other threads emptied
+ */
+static inline void collectFull (uint32_t c) {
+	page_t* p = full_pages[c];
+	while (p != NULL) {
+		page_t* next = p->next;
+		if (collect (p)) {
+			listRemove (&full_pages[c], p);
+			p->full = false;
+			listPush (&queues[c], p);
+			if (p->used == 0)
+				retire (p);
+		}
+		p = next;
+	}
+}
+
+/*
+ * mallocSmall - the slow path of malloc for class c: refills or skips past
+ * 		spans with an empty free list until one has a block
+ */
+static address mallocSmall (uint32_t c) {
+	page_t* p = queues[c];
+	for (;;) {
+		if (p == NULL) {
+			if (atomic_load_explicit (&thread_frees, memory_order_relaxed) != 0)
+				collectFull (c);
+			p = queues[c] != NULL ? queues[c] : newSmallSpan (c);
+			if (p == NULL)
+				return NULL;
+		}
+		if (p->free != NULL || collect (p) || extend (p))
+			break;
+		page_t* next = p->next;
+		listRemove (&queues[c], p);
+		p->full = true;
+		listPush (&full_pages[c], p);
+		p = next;
+	}
+	address bp = p->free;
+	p->free = *nextFree(bp);
+	p->used++;
+	return bp;
+}
+
+/* Frees the large spans other threads have handed back */
+static inline void collectLarge (void) {
+	address list = atomic_exchange_explicit (&deferred_large, NULL, memory_order_acquire);
+	while (list != NULL) {
+		address next = *nextFree(list);
+		page_t* p = pageOf (list);
+		freeSpan ((uint32_t)(p - pages), p->count);
+		atomic_fetch_sub_explicit (&thread_frees, 1, memory_order_relaxed);
+		list = next;
+	}
+}
+
+static inline address mallocLarge (size_t size) {
+	if (atomic_load_explicit (&deferred_large, memory_order_relaxed) != NULL)
+		collectLarge ();
+	page_t* p = allocSpan (pagesFor (size), SPAN_LARGE);
+	return p != NULL ? spanStart (p) : NULL;
+}
+
+int
+mm_init (void)
+{
+	memset (pages, 0, heap_pages * sizeof(page_t));
+	memset (queues, 0, sizeof(queues));
+	memset (full_pages, 0, sizeof(full_pages));
+	memset (span_bins, 0, sizeof(span_bins));
+	atomic_store (&deferred_large, NULL);
+	atomic_store (&thread_frees, 0);
+	heap_owner = &thread_tag;
+	heap_pages = 0;
+	address brk = mem_sbrk (0);
+	size_t pad = (size_t)(-(uintptr_t)brk & (PAGE_SIZE - 1));
+	if (brk == (void *)-1 || mem_sbrk ((int)pad) == (void *)-1)
+		return -1;
+	heap_base = brk + pad;
+#if defined(MM_STATS)
+	memset (&stats, 0, sizeof(stats));
+#endif
+	return 0;
+}
+
+void*
+mm_malloc (uint32_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > SMALL_MAX) {
+		return mallocLarge (size);
+	}
+	uint32_t c = classOf (size);
+	page_t* p = queues[c];
+	if (p != NULL && p->free != NULL) {
+		address bp = p->free;
+		p->free = *nextFree(bp);
+		p->used++;
+		return bp;
+	}
+	return mallocSmall (c);
+}
+
+void*
+mm_memalign (uint32_t alignment, uint32_t size)
+{
+	if (size == 0 || (alignment & (alignment - 1)) != 0) {
+		return NULL;
+	}
+	if (alignment <= 16) {
+		return mm_malloc (size);
+	}
+	// Spans start on a page, so a class whose size is a multiple of the
+	// alignment only ever hands out aligned blocks
+	if (alignment <= PAGE_SIZE && size <= SMALL_MAX) {
+		for (uint32_t c = classOf (size); c < CLASS_COUNT; c++) {
+			if (classSize (c) % alignment == 0) {
+				return mm_malloc (classSize (c));
+			}
+		}
+	}
+	if (alignment <= PAGE_SIZE) {
+		return mallocLarge (size);
+	}
+	// Take enough pages to find an aligned run in, and free what's left
+	// on either side of it
+	uint32_t count = pagesFor (size);
+	page_t* p = allocSpan (count + alignment / PAGE_SIZE - 1, SPAN_LARGE);
+	if (p == NULL) {
+		return NULL;
+	}
+	uint32_t first = (uint32_t)(p - pages);
+	uint32_t skip = (uint32_t)((-(uintptr_t)spanStart (p) & (alignment - 1)) >> PAGE_SHIFT);
+	uint32_t total = p->count;
+	if (skip > 0) {
+		setSpan (first, skip, SPAN_LARGE);
+		setSpan (first + skip, total - skip, SPAN_LARGE);
+		freeSpan (first, skip);
+	}
+	p = &pages[first + skip];
+	trimSpan (p, count, SPAN_LARGE);
+	return spanStart (p);
+}
+
+void*
+mm_malloc_cacheline (uint32_t size)
+{
+	return mm_memalign (MM_CACHELINE, size);
+}
+
+void
+mm_free (void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	address bp = (address)ptr;
+	page_t* p = pageOf (bp);
+	if (heap_owner != &thread_tag) {
+		_Atomic(address)* list = p->kind == SPAN_SMALL ? &p->thread_free : &deferred_large;
+		address head = atomic_load_explicit (list, memory_order_relaxed);
+		do {
+			*nextFree(bp) = head;
+		} while (!atomic_compare_exchange_weak_explicit (list, &head, bp,
+			memory_order_release, memory_order_relaxed));
+		atomic_fetch_add_explicit (&thread_frees, 1, memory_order_relaxed);
+		return;
+	}
+	if (p->kind == SPAN_LARGE) {
+		freeSpan ((uint32_t)(p - pages), p->count);
+		return;
+	}
+	*nextFree(bp) = p->local_free;
+	p->local_free = bp;
+	p->used--;
+	if (p->full) {
+		listRemove (&full_pages[p->sizeClass], p);
+		p->full = false;
+		listPush (&queues[p->sizeClass], p);
+	}
+	if (p->used == 0) {
+		retire (p);
+	}
+}
+
+/*
+ * growSpan - grows a large span in place to count pages, into a free span
+ * 		after it or the end of the heap. Returns whether it could.
+ */
+static inline bool growSpan (page_t* p, uint32_t count) {
+	uint32_t first = (uint32_t)(p - pages);
+	uint32_t end = first + p->count;
+	uint32_t have = p->count;
+	if (end < heap_pages && pages[end].kind == SPAN_FREE) {
+		have += pages[end].count;
+		end += pages[end].count;
+	}
+	if (have < count && end < heap_pages)
+		return false;
+	if (have < count) {
+		if ((size_t)first + count > MAX_PAGES ||
+		    mem_sbrk ((int)((count - have) * PAGE_SIZE)) == (void *)-1)
+			return false;
+		heap_pages += count - have;
+	}
+	if (have > p->count) {
+		page_t* next = &pages[first + p->count];
+		listRemove (&span_bins[binOf (next->count)], next);
+	}
+	setSpan (first, have < count ? count : have, SPAN_LARGE);
+	trimSpan (p, count, SPAN_LARGE);
+	return true;
+}
+
+void*
+mm_realloc (void *ptr, uint32_t size)
+{
+	if (ptr == NULL) {
+		return mm_malloc (size);
+	}
+	if (size == 0) {
+		mm_free (ptr);
+		return NULL;
+	}
+	address bp = (address)ptr;
+	page_t* p = pageOf (bp);
+	size_t payload;
+	if (p->kind == SPAN_SMALL) {
+		payload = p->blockSize;
+		if (size <= payload && size > payload / 2) {
+			return ptr;
+		}
+	} else {
+		payload = (size_t)p->count * PAGE_SIZE;
+		uint32_t count = pagesFor (size);
+		if (size > SMALL_MAX && count <= p->count) {
+			trimSpan (p, count, SPAN_LARGE);
+			return ptr;
+		}
+		if (size > SMALL_MAX && growSpan (p, count)) {
+			return ptr;
+		}
+	}
+	address newPtr = mm_malloc (size);
+	if (newPtr == NULL) {
+		return NULL;
+	}
+	if (payload > size) {
+		payload = size;
+	}
+	// Both spans start on a page, so big payloads can move by remapping
+	if (p->kind == SPAN_LARGE && pageOf (newPtr)->kind == SPAN_LARGE &&
+	    payload >= REMAP_MIN && mem_remap (newPtr, bp, payload & ~(size_t)(PAGE_SIZE - 1)) == 0) {
+		size_t moved = payload & ~(size_t)(PAGE_SIZE - 1);
+		memcpy (newPtr + moved, bp + moved, payload - moved);
+#if defined(MM_STATS)
+		stats.realloc_remapped += moved;
+		stats.realloc_copied += payload - moved;
+#endif
+	} else {
+		memcpy (newPtr, ptr, payload);
+#if defined(MM_STATS)
+		stats.realloc_copied += payload;
+#endif
+	}
+	mm_free (ptr);
+	return newPtr;
+}
+
+void
+mm_get_stats (mm_stats_t *out)
+{
+#if defined(MM_STATS)
+	*out = stats;
+#else
+	memset (out, 0, sizeof(*out));
+#endif
+}
+
+int mm_check(void)
+{
+	// Spans tile the heap, no two free spans touch, and every free span is
+	// in the bin for its length
+	bool prevFree = false;
+	uint32_t freeSpans = 0;
+	for (uint32_t i = 0; i < heap_pages; i += pages[i].count) {
+		page_t* p = &pages[i];
+		page_t* last = &pages[i + p->count - 1];
+		if (p->count == 0 || i + p->count > heap_pages || p->start != i ||
+		    last->start != i || last->kind != p->kind)
+			return 0;
+		if (p->kind == SPAN_FREE) {
+			if (prevFree)
+				return 0;
+			freeSpans++;
+		} else if (p->kind == SPAN_SMALL) {
+			// Each block is out, on one of the span's lists, or not carved yet
+			uint32_t onLists = 0;
+			address lists[2] = { p->free, p->local_free };
+			for (int l = 0; l < 2; l++) {
+				for (address bp = lists[l]; bp != NULL; bp = *nextFree(bp)) {
+					size_t off = (size_t)(bp - spanStart (p));
+					if (off % p->blockSize != 0 || off / p->blockSize >= p->capacity)
+						return 0;
+					onLists++;
+				}
+			}
+			if (p->used + onLists != p->capacity || p->capacity > p->reserved)
+				return 0;
+			if (p->sizeClass >= CLASS_COUNT || classSize (p->sizeClass) != p->blockSize)
+				return 0;
+		}
+		prevFree = p->kind == SPAN_FREE;
+	}
+	for (uint32_t bin = 0; bin < SPAN_BINS; bin++) {
+		for (page_t* p = span_bins[bin]; p != NULL; p = p->next) {
+			if (p->kind != SPAN_FREE || binOf (p->count) != bin)
+				return 0;
+			freeSpans--;
+		}
+	}
+	return freeSpans == 0;
+}
@@ -0,0 +1,753 @@
+/*
+ * mm_percpu.c - per-CPU caches of small objects in front of whichever
+ * 		allocator engine is linked in
+ *
+ * The engines aren't thread safe, so every call into one is made under
+ * heap_lock. To keep most calls away from that lock, objects of up to
+ * CACHE_OBJ_MAX bytes are cached by size class: each CPU has an array of
+ * free objects per class with a count of how many it holds. A free pushes
+ * onto the array of the CPU the thread is running on, a malloc pops from it,
+ * and only an empty or full array goes to the engine, CACHE_BATCH objects
+ * at a time. Memory sitting in caches then grows with the number of CPUs,
+ * not the number of threads.
+ *
+ * On x86-64 Linux the push and pop are restartable sequences: the slot is
+ * written first and the count stored last, and the kernel restarts the
+ * sequence if the thread is preempted or migrated before that store. Where
+ * rseq isn't registered, each CPU's caches are guarded by a lock instead,
+ * and the CPU comes from sched_getcpu.
+ *
+ * mm_thread_malloc and mm_thread_free do the same with one set of caches
+ * per thread, which needs no synchronization at all but holds memory for
+ * every thread. A thread's caches go back to the engine when it exits.
+ *
+ * mm_mag_malloc and mm_mag_free put a magazine layer between per-thread
+ * caches and the engine. A thread holds a loaded magazine and a spare of
+ * MAG_ROUNDS objects per class; when both are empty, or both full, it
+ * trades a whole magazine with the class's depot, which keeps lists of full
+ * and empty magazines under a lock of its own. Objects a thread frees then
+ * reach a thread that allocates a magazine at a time, and the engine only
+ * sees the traffic the depot can't absorb.
+ *
+ * Objects are freed with their size, so no header or page map is needed to
+ * find their class. Built with -DMM_LOCK_STATS, every lock counts how often
+ * it is taken and how long threads wait for it (mm_cpu_get_lock_stats).
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/rseq.h>
+#endif
+
+#include "mm.h"
+#include "mm_class.h"
+#include "mm_lock.h"
+
+#if defined(__x86_64__) && defined(RSEQ_SIG)
+#define HAVE_RSEQ 1
+#endif
+
+#define CPU_MAX 256
+#define CACHE_OBJ_MAX MM_CLASS_MAX
+#define CACHE_CLASSES MM_CLASSES
+// Objects a cache holds per class, and how many move to or from the engine
+// when it runs empty or full
+#define CACHE_SLOTS 64
+#define CACHE_BATCH 16
+
+typedef struct objCache {
+	uint32_t count[CACHE_CLASSES];
+	void* slots[CACHE_CLASSES][CACHE_SLOTS];
+} objCache;
+
+// Objects a magazine holds
+#define MAG_ROUNDS 32
+
+typedef struct magazine {
+	struct magazine* next;   // in a depot list
+	uint32_t rounds;
+	void* objs[MAG_ROUNDS];
+} magazine;
+
+// A thread's magazines of each class, NULL until the class is first used
+typedef struct magCache {
+	magazine* loaded[CACHE_CLASSES];
+	magazine* spare[CACHE_CLASSES];
+} magCache;
+
+typedef struct depot {
+	_Alignas(MM_CACHELINE) pthread_mutex_t lock;
+	magazine* full;
+	magazine* empty;
+	mm_depot_stats_t stats;
+	mm_lock_stats_t lockStats;
+} depot;
+
+typedef struct cpuCache {
+	_Alignas(MM_CACHELINE) objCache objs;
+	pthread_mutex_t lock;   // guards objs when rseq isn't used
+	mm_lock_stats_t lockStats;
+} cpuCache;
+
+static cpuCache cpus[CPU_MAX];
+static bool use_rseq;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static mm_lock_stats_t heap_lock_stats;
+// Bytes the front ends hold from the engine, handed out or cached
+static uint64_t heap_bytes;
+
+static depot depots[CACHE_CLASSES];
+
+static _Thread_local objCache thread_objs;
+static _Thread_local magCache thread_mags;
+static _Thread_local bool thread_registered;
+static pthread_key_t thread_key;
+static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
+
+static inline bool objPop (objCache* oc, uint32_t c, void** out)
+{
+	if (oc->count[c] == 0)
+		return false;
+	*out = oc->slots[c][--oc->count[c]];
+	return true;
+}
+
+static inline bool objPush (objCache* oc, uint32_t c, void* obj)
+{
+	if (oc->count[c] == CACHE_SLOTS)
+		return false;
+	oc->slots[c][oc->count[c]++] = obj;
+	return true;
+}
+
+#if defined(HAVE_RSEQ)
+static inline struct rseq* rseqArea (void)
+{
+	return (struct rseq*)((char*)__builtin_thread_pointer () + __rseq_offset);
+}
+
+/*
+ * rseqPop - pops an object of class c off the cache of cpu, as long as the
+ * 		thread is still on cpu. Returns 1 when it did, 0 when the cache is
+ * 		empty and -1 when the sequence was aborted.
+ */
+static inline int rseqPop (uint32_t cpu, uint32_t c, void** out)
+{
+	objCache* oc = &cpus[cpu].objs;
+	__asm__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs](%[rs])\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %c[cpuid](%[rs])\n\t"
+		"jnz 4f\n\t"
+		"movl (%[count]), %%ecx\n\t"
+		"testl %%ecx, %%ecx\n\t"
+		"jz %l[empty]\n\t"
+		"movq -8(%[slots], %%rcx, 8), %%rdx\n\t"
+		"movq %%rdx, (%[out])\n\t"
+		"decl %%ecx\n\t"
+		// Commit
+		"movl %%ecx, (%[count])\n\t"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [rs] "r" (rseqArea ()), [cpu] "r" (cpu), [count] "r" (&oc->count[c]),
+		  [slots] "r" (oc->slots[c]), [out] "r" (out),
+		  [cs] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpuid] "i" (offsetof(struct rseq, cpu_id)), [sig] "i" (RSEQ_SIG)
+		: "memory", "cc", "rax", "rcx", "rdx"
+		: empty, abort);
+	return 1;
+empty:
+	return 0;
+abort:
+	return -1;
+}
+
+/*
+ * rseqPush - pushes obj onto the class c cache of cpu, as long as the
+ * 		thread is still on cpu. Returns 1 when it did, 0 when the cache is
+ * 		full and -1 when the sequence was aborted.
+ */
+static inline int rseqPush (uint32_t cpu, uint32_t c, void* obj)
+{
+	objCache* oc = &cpus[cpu].objs;
+	__asm__ goto (
+		".pushsection __rseq_cs, \"aw\"\n\t"
+		".balign 32\n\t"
+		"3:\n\t"
+		".long 0x0, 0x0\n\t"
+		".quad 1f, (2f - 1f), 4f\n\t"
+		".popsection\n\t"
+		"leaq 3b(%%rip), %%rax\n\t"
+		"movq %%rax, %c[cs](%[rs])\n\t"
+		"1:\n\t"
+		"cmpl %[cpu], %c[cpuid](%[rs])\n\t"
+		"jnz 4f\n\t"
+		"movl (%[count]), %%ecx\n\t"
+		"cmpl %[cap], %%ecx\n\t"
+		"jae %l[full]\n\t"
+		"movq %[obj], (%[slots], %%rcx, 8)\n\t"
+		"incl %%ecx\n\t"
+		// Commit
+		"movl %%ecx, (%[count])\n\t"
+		"2:\n\t"
+		".pushsection __rseq_failure, \"ax\"\n\t"
+		".byte 0x0f, 0xb9, 0x3d\n\t"
+		".long %c[sig]\n\t"
+		"4:\n\t"
+		"jmp %l[abort]\n\t"
+		".popsection\n\t"
+		:
+		: [rs] "r" (rseqArea ()), [cpu] "r" (cpu), [count] "r" (&oc->count[c]),
+		  [slots] "r" (oc->slots[c]), [obj] "r" (obj), [cap] "i" (CACHE_SLOTS),
+		  [cs] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpuid] "i" (offsetof(struct rseq, cpu_id)), [sig] "i" (RSEQ_SIG)
+		: "memory", "cc", "rax", "rcx"
+		: full, abort);
+	return 1;
+full:
+	return 0;
+abort:
+	return -1;
+}
+#endif
+
+/* The cache of the CPU the thread is on, locked */
+static inline cpuCache* lockCpu (void)
+{
+	int cpu = sched_getcpu ();
+	cpuCache* cc = &cpus[cpu < 0 ? 0 : cpu % CPU_MAX];
+	lockMutex (&cc->lock, &cc->lockStats);
+	return cc;
+}
+
+/*
+ * cpuPop, cpuPush - pop and push on the cache of the CPU the thread is on.
+ * 		They return false when the cache is empty or full.
+ */
+static inline bool cpuPop (uint32_t c, void** out)
+{
+#if defined(HAVE_RSEQ)
+	if (use_rseq) {
+		int done;
+		while ((done = rseqPop (rseqArea ()->cpu_id_start, c, out)) < 0)
+			;
+		return done;
+	}
+#endif
+	cpuCache* cc = lockCpu ();
+	bool done = objPop (&cc->objs, c, out);
+	pthread_mutex_unlock (&cc->lock);
+	return done;
+}
+
+static inline bool cpuPush (uint32_t c, void* obj)
+{
+#if defined(HAVE_RSEQ)
+	if (use_rseq) {
+		int done;
+		while ((done = rseqPush (rseqArea ()->cpu_id_start, c, obj)) < 0)
+			;
+		return done;
+	}
+#endif
+	cpuCache* cc = lockCpu ();
+	bool done = objPush (&cc->objs, c, obj);
+	pthread_mutex_unlock (&cc->lock);
+	return done;
+}
+
+/*
+ * takeBatch - takes up to CACHE_BATCH objects of class c from the engine.
+ * 		Returns how many it got.
+ */
+static uint32_t takeBatch (uint32_t c, void** batch)
+{
+	uint32_t n = 0;
+	lockMutex (&heap_lock, &heap_lock_stats);
+	while (n < CACHE_BATCH && (batch[n] = mm_malloc (classSize (c))) != NULL)
+		n++;
+	heap_bytes += (uint64_t)n * classSize (c);
+	pthread_mutex_unlock (&heap_lock);
+	return n;
+}
+
+/* Gives n objects of class c back to the engine */
+static void giveBatch (uint32_t c, void** batch, uint32_t n)
+{
+	lockMutex (&heap_lock, &heap_lock_stats);
+	for (uint32_t i = 0; i < n; i++)
+		mm_free (batch[i]);
+	heap_bytes -= (uint64_t)n * classSize (c);
+	pthread_mutex_unlock (&heap_lock);
+}
+
+static void* lockedMalloc (uint32_t size)
+{
+	lockMutex (&heap_lock, &heap_lock_stats);
+	void* bp = mm_malloc (size);
+	if (bp != NULL)
+		heap_bytes += size;
+	pthread_mutex_unlock (&heap_lock);
+	return bp;
+}
+
+static void lockedFree (void* ptr, uint32_t size)
+{
+	lockMutex (&heap_lock, &heap_lock_stats);
+	mm_free (ptr);
+	heap_bytes -= size;
+	pthread_mutex_unlock (&heap_lock);
+}
+
+/*
+ * mm_cpu_init - empties the per-CPU caches and the depots, whose objects
+ * 		went with the heap at the last mm_init, and picks rseq or locks.
+ * 		Call it after mm_init and before any thread uses the front ends.
+ */
+void
+mm_cpu_init (void)
+{
+	for (uint32_t i = 0; i < CPU_MAX; i++) {
+		memset (&cpus[i].objs, 0, sizeof(objCache));
+		memset (&cpus[i].lockStats, 0, sizeof(mm_lock_stats_t));
+		pthread_mutex_init (&cpus[i].lock, NULL);
+	}
+	for (uint32_t c = 0; c < CACHE_CLASSES; c++) {
+		depots[c].full = depots[c].empty = NULL;
+		memset (&depots[c].stats, 0, sizeof(mm_depot_stats_t));
+		memset (&depots[c].lockStats, 0, sizeof(mm_lock_stats_t));
+		pthread_mutex_init (&depots[c].lock, NULL);
+	}
+	heap_bytes = 0;
+	memset (&heap_lock_stats, 0, sizeof(mm_lock_stats_t));
+	use_rseq = false;
+#if defined(HAVE_RSEQ)
+	// Every CPU needs a cache of its own for rseq to be safe
+	use_rseq = __rseq_size > 0 && get_nprocs_conf () <= CPU_MAX;
+#endif
+}
+
+/*
+ * mm_cpu_malloc - size bytes from the cache of the CPU the thread is on,
+ * 		refilled from the engine when empty
+ */
+void*
+mm_cpu_malloc (uint32_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > CACHE_OBJ_MAX) {
+		return lockedMalloc (size);
+	}
+	uint32_t c = classOf (size);
+	void* bp;
+	if (cpuPop (c, &bp)) {
+		return bp;
+	}
+	void* batch[CACHE_BATCH];
+	uint32_t n = takeBatch (c, batch);
+	if (n == 0) {
+		return NULL;
+	}
+	// Keep one, cache the rest while there's room
+	uint32_t kept = 1;
+	while (kept < n && cpuPush (c, batch[kept]))
+		kept++;
+	if (kept < n)
+		giveBatch (c, batch + kept, n - kept);
+	return batch[0];
+}
+
+/*
+ * mm_cpu_free - puts ptr, which mm_cpu_malloc returned for size bytes, on
+ * 		the cache of the CPU the thread is on, draining a batch of the cache
+ * 		to the engine when it is full
+ */
+void
+mm_cpu_free (void *ptr, uint32_t size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (size > CACHE_OBJ_MAX) {
+		lockedFree (ptr, size);
+		return;
+	}
+	uint32_t c = classOf (size);
+	if (cpuPush (c, ptr)) {
+		return;
+	}
+	void* batch[CACHE_BATCH];
+	uint32_t n = 0;
+	batch[n++] = ptr;
+	while (n < CACHE_BATCH && cpuPop (c, &batch[n]))
+		n++;
+	giveBatch (c, batch, n);
+}
+
+static void depotPut (uint32_t c, magazine* m);
+
+/*
+ * threadExit - gives everything cached by a thread that is exiting back to
+ * 		the engine, and its magazines to the depots
+ */
+static void threadExit (void* arg)
+{
+	objCache* oc = arg;
+	for (uint32_t c = 0; c < CACHE_CLASSES; c++) {
+		giveBatch (c, oc->slots[c], oc->count[c]);
+		oc->count[c] = 0;
+		magazine* mags[2] = { thread_mags.loaded[c], thread_mags.spare[c] };
+		for (int i = 0; i < 2; i++) {
+			if (mags[i] == NULL)
+				continue;
+			if (mags[i]->rounds != MAG_ROUNDS) {
+				giveBatch (c, mags[i]->objs, mags[i]->rounds);
+				mags[i]->rounds = 0;
+			}
+			depotPut (c, mags[i]);
+		}
+		thread_mags.loaded[c] = thread_mags.spare[c] = NULL;
+	}
+}
+
+static void threadKey (void)
+{
+	pthread_key_create (&thread_key, threadExit);
+}
+
+static inline void registerThread (void)
+{
+	if (!thread_registered) {
+		pthread_once (&thread_once, threadKey);
+		pthread_setspecific (thread_key, &thread_objs);
+		thread_registered = true;
+	}
+}
+
+/*
+ * mm_thread_malloc - like mm_cpu_malloc, with caches of the calling thread's
+ * 		own
+ */
+void*
+mm_thread_malloc (uint32_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > CACHE_OBJ_MAX) {
+		return lockedMalloc (size);
+	}
+	uint32_t c = classOf (size);
+	void* bp;
+	if (objPop (&thread_objs, c, &bp)) {
+		return bp;
+	}
+	registerThread ();
+	void* batch[CACHE_BATCH];
+	uint32_t n = takeBatch (c, batch);
+	if (n == 0) {
+		return NULL;
+	}
+	for (uint32_t i = 1; i < n; i++)
+		objPush (&thread_objs, c, batch[i]);
+	return batch[0];
+}
+
+/*
+ * mm_thread_free - like mm_cpu_free, with caches of the calling thread's own
+ */
+void
+mm_thread_free (void *ptr, uint32_t size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (size > CACHE_OBJ_MAX) {
+		lockedFree (ptr, size);
+		return;
+	}
+	uint32_t c = classOf (size);
+	if (objPush (&thread_objs, c, ptr)) {
+		return;
+	}
+	void* batch[CACHE_BATCH];
+	uint32_t n = 0;
+	batch[n++] = ptr;
+	while (n < CACHE_BATCH && objPop (&thread_objs, c, &batch[n]))
+		n++;
+	giveBatch (c, batch, n);
+}
+
+/* depotLock, depotUnlock - take and drop a depot's lock, timing the hold */
+static inline uint64_t depotLock (depot* d)
+{
+	lockMutex (&d->lock, &d->lockStats);
+	d->stats.locks++;
+	return holdClock ();
+}
+
+static inline void depotUnlock (depot* d, uint64_t start)
+{
+	d->stats.hold_cycles += holdClock () - start;
+	pthread_mutex_unlock (&d->lock);
+}
+
+/* Puts magazine m on the full or empty list of the class c depot */
+static void depotPut (uint32_t c, magazine* m)
+{
+	depot* d = &depots[c];
+	uint64_t start = depotLock (d);
+	magazine** list = m->rounds == 0 ? &d->empty : &d->full;
+	m->next = *list;
+	*list = m;
+	depotUnlock (d, start);
+}
+
+/*
+ * depotTrade - gives m to the class c depot in exchange for a magazine off
+ * 		the other list: an empty m for a full one, a full m for an empty one.
+ * 		Returns NULL, and keeps m, when the depot has none.
+ */
+static magazine* depotTrade (uint32_t c, magazine* m)
+{
+	depot* d = &depots[c];
+	bool full = m->rounds != 0;
+	uint64_t start = depotLock (d);
+	magazine** want = full ? &d->empty : &d->full;
+	magazine* got = *want;
+	if (got != NULL) {
+		*want = got->next;
+		magazine** give = full ? &d->full : &d->empty;
+		m->next = *give;
+		*give = m;
+	}
+	if (full) {
+		d->stats.puts++;
+		d->stats.put_hits += got != NULL;
+	} else {
+		d->stats.gets++;
+		d->stats.get_hits += got != NULL;
+	}
+	depotUnlock (d, start);
+	return got;
+}
+
+/* An empty magazine, from the depot or newly taken from the engine */
+static magazine* emptyMagazine (uint32_t c)
+{
+	depot* d = &depots[c];
+	uint64_t start = depotLock (d);
+	magazine* m = d->empty;
+	if (m != NULL)
+		d->empty = m->next;
+	depotUnlock (d, start);
+	if (m == NULL) {
+		m = lockedMalloc (sizeof(magazine));
+		if (m == NULL)
+			return NULL;
+	}
+	m->rounds = 0;
+	return m;
+}
+
+/* Gives the thread its first magazines of class c */
+static bool loadMagazines (uint32_t c)
+{
+	registerThread ();
+	if (thread_mags.loaded[c] == NULL &&
+	    (thread_mags.loaded[c] = emptyMagazine (c)) == NULL)
+		return false;
+	if (thread_mags.spare[c] == NULL &&
+	    (thread_mags.spare[c] = emptyMagazine (c)) == NULL)
+		return false;
+	return true;
+}
+
+/*
+ * mm_mag_malloc - size bytes from the calling thread's loaded magazine,
+ * 		swapping in its spare, then a full magazine from the depot, when it
+ * 		is empty. Only when the depot has no full magazine is the loaded one
+ * 		refilled from the engine.
+ */
+void*
+mm_mag_malloc (uint32_t size)
+{
+	if (size == 0) {
+		return NULL;
+	}
+	if (size > CACHE_OBJ_MAX) {
+		return lockedMalloc (size);
+	}
+	uint32_t c = classOf (size);
+	magazine* m = thread_mags.loaded[c];
+	if (m != NULL && m->rounds != 0) {
+		return m->objs[--m->rounds];
+	}
+	if (m == NULL) {
+		if (!loadMagazines (c))
+			return NULL;
+		m = thread_mags.loaded[c];
+	}
+	magazine* spare = thread_mags.spare[c];
+	if (spare->rounds != 0) {
+		thread_mags.loaded[c] = spare;
+		thread_mags.spare[c] = m;
+		return spare->objs[--spare->rounds];
+	}
+	// Both are empty: trade the spare for a full one
+	magazine* full = depotTrade (c, spare);
+	if (full != NULL) {
+		thread_mags.spare[c] = m;
+		thread_mags.loaded[c] = full;
+		return full->objs[--full->rounds];
+	}
+	m->rounds = takeBatch (c, m->objs);
+	if (m->rounds == 0) {
+		return NULL;
+	}
+	return m->objs[--m->rounds];
+}
+
+/*
+ * mm_mag_free - puts ptr, which mm_mag_malloc returned for size bytes, in
+ * 		the calling thread's loaded magazine, swapping in its spare, then an
+ * 		empty magazine from the depot, when it is full. Only when the depot
+ * 		has no empty magazine and a new one can't be had does ptr go back to
+ * 		the engine.
+ */
+void
+mm_mag_free (void *ptr, uint32_t size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	if (size > CACHE_OBJ_MAX) {
+		lockedFree (ptr, size);
+		return;
+	}
+	uint32_t c = classOf (size);
+	magazine* m = thread_mags.loaded[c];
+	if (m != NULL && m->rounds != MAG_ROUNDS) {
+		m->objs[m->rounds++] = ptr;
+		return;
+	}
+	if (m == NULL) {
+		if (!loadMagazines (c)) {
+			giveBatch (c, &ptr, 1);
+			return;
+		}
+		m = thread_mags.loaded[c];
+	}
+	magazine* spare = thread_mags.spare[c];
+	if (spare->rounds != MAG_ROUNDS) {
+		thread_mags.loaded[c] = spare;
+		thread_mags.spare[c] = m;
+		spare->objs[spare->rounds++] = ptr;
+		return;
+	}
+	// Both are full: trade the spare for an empty one
+	magazine* empty = depotTrade (c, spare);
+	if (empty == NULL) {
+		if ((empty = lockedMalloc (sizeof(magazine))) == NULL) {
+			giveBatch (c, &ptr, 1);
+			return;
+		}
+		empty->rounds = 0;
+		depotPut (c, spare);
+	}
+	thread_mags.spare[c] = m;
+	thread_mags.loaded[c] = empty;
+	empty->objs[empty->rounds++] = ptr;
+}
+
+/*
+ * mm_mag_get_stats - adds up the counters of every depot
+ */
+void
+mm_mag_get_stats (mm_depot_stats_t *stats)
+{
+	memset (stats, 0, sizeof(mm_depot_stats_t));
+	for (uint32_t c = 0; c < CACHE_CLASSES; c++) {
+		depot* d = &depots[c];
+		pthread_mutex_lock (&d->lock);
+		stats->gets += d->stats.gets;
+		stats->get_hits += d->stats.get_hits;
+		stats->puts += d->stats.puts;
+		stats->put_hits += d->stats.put_hits;
+		stats->locks += d->stats.locks;
+		stats->hold_cycles += d->stats.hold_cycles;
+		pthread_mutex_unlock (&d->lock);
+	}
+}
+
+/*
+ * mm_cpu_get_lock_stats - the counters of the front ends' locks, summed over
+ * 		every CPU and every depot. They read as zero unless mm_percpu.c is
+ * 		built with -DMM_LOCK_STATS.
+ */
+void
+mm_cpu_get_lock_stats (mm_cpu_lock_stats_t *stats)
+{
+	memset (stats, 0, sizeof(mm_cpu_lock_stats_t));
+	pthread_mutex_lock (&heap_lock);
+	stats->heap = heap_lock_stats;
+	pthread_mutex_unlock (&heap_lock);
+	for (uint32_t i = 0; i < CPU_MAX; i++) {
+		pthread_mutex_lock (&cpus[i].lock);
+		addLockStats (&stats->cpus, &cpus[i].lockStats);
+		pthread_mutex_unlock (&cpus[i].lock);
+	}
+	for (uint32_t c = 0; c < CACHE_CLASSES; c++) {
+		pthread_mutex_lock (&depots[c].lock);
+		addLockStats (&stats->depots, &depots[c].lockStats);
+		pthread_mutex_unlock (&depots[c].lock);
+	}
+}
+
+/*
+ * mm_cpu_heap_bytes - bytes the front ends hold from the engine, whether
+ * 		handed out, sitting in a cache or making up a magazine
+ */
+uint64_t
+mm_cpu_heap_bytes (void)
+{
+	pthread_mutex_lock (&heap_lock);
+	uint64_t bytes = heap_bytes;
+	pthread_mutex_unlock (&heap_lock);
+	return bytes;
+}
+
+/*
+ * mm_cpu_rseq - whether mm_cpu_malloc and mm_cpu_free use rseq rather than
+ * 		per-CPU locks
+ */
+int
+mm_cpu_rseq (void)
+{
+	return use_rseq;
+}
@@ -0,0 +1,320 @@
+/*
+ * mm_pool.c - fixed-size object pools on top of whichever allocator engine
+ * 		is linked in
+ *
+ * A pool carves objects of one size out of slabs. A slab is aligned to its
+ * own size, so the slab an object belongs to is its address with the low
+ * bits masked off, and the slab's head sits at its start. Free objects of a
+ * slab are kept on a singly linked list threaded through the objects
+ * themselves; objects past the highest one handed out yet aren't on the
+ * list, they are bumped off the end of the slab as needed.
+ *
+ * Slabs are cut from regions of up to REGION_SIZE bytes taken from mm_malloc
+ * with a slab's worth of slack, which the pool aligns its slabs in itself.
+ * An engine's mm_memalign can leave a free gap in front of every aligned
+ * block it hands out, and on a first-fit engine those gaps end up as small
+ * fragments every later mm_malloc walks past. Slabs not in use wait on the
+ * pool's spare list, and a region goes back to mm_free once none of its
+ * slabs is in use.
+ *
+ * Slabs with free objects are kept on a list, most recently freed into
+ * first. When a slab empties it goes back to the spare list, unless it is
+ * the only slab the pool has with room in it.
+ *
+ * A pool made with mm_pool_create_cache is an object cache: its objects are
+ * constructed once, when they are first carved out of a slab, and keep their
+ * constructed state while they sit on a free list, so the free list link goes
+ * after the object instead of over its first word. A cache keeps its empty
+ * slabs, constructed objects and all, until mm_pool_reap or mm_pool_destroy
+ * gives them back, and only then runs the destructor.
+ *
+ * The bytes a slab has left over after its objects shift the first object
+ * by a cache line more on each new slab, so the same field of objects in
+ * different slabs doesn't always land in the same cache set.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm.h"
+
+#define ALIGNMENT 16
+#define MIN_SLAB 4096
+// Slabs grow past MIN_SLAB until they hold at least this many objects
+#define SLAB_OBJECTS 8
+#define REGION_SIZE (1 << 16)
+// Largest object or alignment whose rounding, free list link included,
+// still fits in 32 bits
+#define MAX_SIZE (UINT32_MAX / 2 - 2 * ALIGNMENT)
+
+typedef uint8_t byte;
+typedef byte* address;
+
+typedef struct slab {
+	address free;        // freed objects
+	struct slab* next;   // slabs with room, slabs that are full, or spares
+	struct slab* prev;
+	struct slab* region; // the first slab of the region this one is in
+	address block;       // in a region's first slab: what mm_malloc returned
+	uint32_t inUse;      // in a region's first slab: its slabs not spare
+	uint32_t used;       // objects handed out
+	uint32_t capacity;   // objects carved out so far
+	uint32_t first;      // offset of the first object
+	bool full;
+} slab;
+
+struct mm_pool {
+	slab* partial;
+	slab* full;
+	slab* spare;
+	mm_pool_ctor_t ctor;
+	mm_pool_ctor_t dtor;
+	void* arg;           // passed to ctor and dtor
+	uint32_t objSize;    // object stride, a multiple of the alignment
+	uint32_t link;       // offset of the free list link in an object
+	uint32_t first;      // offset of the first object in an uncolored slab
+	uint32_t reserved;   // objects a slab holds
+	uint32_t slabSize;
+	uint32_t regionSlabs; // slabs in a region
+	uint32_t color;      // extra offset of the first object in the next slab
+	uint32_t colorStep;
+	uint32_t maxColor;
+	bool cache;          // keeps empty slabs for mm_pool_reap
+};
+
+static inline uint32_t alignUp (uint32_t bytes, uint32_t align) {
+	return (bytes + align - 1) & ~(align - 1);
+}
+
+static inline void slabPush (slab** head, slab* s) {
+	s->prev = NULL;
+	s->next = *head;
+	if (*head != NULL)
+		(*head)->prev = s;
+	*head = s;
+}
+
+static inline void slabRemove (slab** head, slab* s) {
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		*head = s->next;
+}
+
+static inline address* linkOf (mm_pool_t* pool, address bp) {
+	return (address*)(bp + pool->link);
+}
+
+/*
+ * takeSlab - a spare slab, taking a new region from mm_malloc when there is
+ * 		none, or NULL when that fails
+ */
+static inline slab* takeSlab (mm_pool_t* pool) {
+	if (pool->spare == NULL) {
+		address block = mm_malloc ((pool->regionSlabs + 1) * pool->slabSize - ALIGNMENT);
+		if (block == NULL)
+			return NULL;
+		address region = (address)(((uintptr_t)block + pool->slabSize - 1) & ~(uintptr_t)(pool->slabSize - 1));
+		// Pushed from the top down, so the region is handed out bottom up
+		for (uint32_t i = pool->regionSlabs; i-- > 0;) {
+			slab* s = (slab*)(region + (size_t)i * pool->slabSize);
+			s->region = (slab*)region;
+			slabPush (&pool->spare, s);
+		}
+		((slab*)region)->block = block;
+		((slab*)region)->inUse = 0;
+	}
+	slab* s = pool->spare;
+	slabRemove (&pool->spare, s);
+	s->region->inUse++;
+	return s;
+}
+
+/*
+ * reclaim - runs the destructor on every object carved out of an empty slab
+ * 		and puts the slab on the spare list, giving its region back to mm_free
+ * 		once none of the region's slabs is in use
+ */
+static inline void reclaim (mm_pool_t* pool, slab* s) {
+	if (pool->dtor != NULL) {
+		address bp = (address)s + s->first;
+		for (uint32_t i = 0; i < s->capacity; i++, bp += pool->objSize)
+			pool->dtor (bp, pool->arg);
+	}
+	slab* region = s->region;
+	slabPush (&pool->spare, s);
+	if (--region->inUse == 0) {
+		for (uint32_t i = 0; i < pool->regionSlabs; i++)
+			slabRemove (&pool->spare, (slab*)((address)region + (size_t)i * pool->slabSize));
+		mm_free (region->block);
+	}
+}
+
+/*
+ * mm_pool_create_cache - makes an empty cache of objects of object_size
+ * 		bytes, each aligned to alignment, a power of two. An alignment of 0
+ * 		means 16. ctor, when given, runs on an object once before it is
+ * 		first handed out, and dtor once when its slab is given back.
+ */
+mm_pool_t*
+mm_pool_create_cache (uint32_t object_size, uint32_t alignment,
+                      mm_pool_ctor_t ctor, mm_pool_ctor_t dtor, void *arg)
+{
+	if (alignment == 0) {
+		alignment = ALIGNMENT;
+	}
+	if (object_size == 0 || object_size > MAX_SIZE || alignment > MAX_SIZE ||
+	    (alignment & (alignment - 1)) != 0) {
+		return NULL;
+	}
+	mm_pool_t* pool = mm_malloc (sizeof(mm_pool_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->partial = pool->full = pool->spare = NULL;
+	pool->ctor = ctor;
+	pool->dtor = dtor;
+	pool->arg = arg;
+	pool->cache = ctor != NULL || dtor != NULL;
+	if (pool->cache) {
+		// Keep the link clear of the constructed object
+		pool->link = alignUp (object_size, (uint32_t)sizeof(address));
+		pool->objSize = alignUp (pool->link + (uint32_t)sizeof(address), alignment);
+	} else {
+		pool->link = 0;
+		pool->objSize = alignUp (object_size < sizeof(address) ? (uint32_t)sizeof(address) : object_size, alignment);
+	}
+	pool->first = alignUp ((uint32_t)sizeof(slab), alignment);
+	uint64_t slabSize = MIN_SLAB;
+	while (slabSize - pool->first < (uint64_t)SLAB_OBJECTS * pool->objSize ||
+	       slabSize < alignment)
+		slabSize *= 2;
+	uint64_t regionSlabs = slabSize < REGION_SIZE ? REGION_SIZE / slabSize : 1;
+	// A region and its slack have to fit one mm_malloc
+	if ((regionSlabs + 1) * slabSize > UINT32_MAX) {
+		mm_free (pool);
+		return NULL;
+	}
+	pool->slabSize = (uint32_t)slabSize;
+	pool->regionSlabs = (uint32_t)regionSlabs;
+	pool->reserved = (pool->slabSize - pool->first) / pool->objSize;
+	pool->color = 0;
+	pool->colorStep = alignment > MM_CACHELINE ? alignment : MM_CACHELINE;
+	pool->maxColor = pool->slabSize - pool->first - pool->reserved * pool->objSize;
+	return pool;
+}
+
+/*
+ * mm_pool_create - makes an empty pool of objects of object_size bytes, each
+ * 		aligned to alignment, a power of two. An alignment of 0 means 16.
+ */
+mm_pool_t*
+mm_pool_create (uint32_t object_size, uint32_t alignment)
+{
+	return mm_pool_create_cache (object_size, alignment, NULL, NULL, NULL);
+}
+
+/*
+ * mm_pool_alloc - an object from the first slab with room, taking a spare
+ * 		slab when there is none
+ */
+void*
+mm_pool_alloc (mm_pool_t *pool)
+{
+	slab* s = pool->partial;
+	if (s == NULL) {
+		s = takeSlab (pool);
+		if (s == NULL) {
+			return NULL;
+		}
+		s->free = NULL;
+		s->used = s->capacity = 0;
+		s->first = pool->first + pool->color;
+		s->full = false;
+		pool->color += pool->colorStep;
+		if (pool->color > pool->maxColor)
+			pool->color = 0;
+		slabPush (&pool->partial, s);
+	}
+	address bp = s->free;
+	if (bp != NULL) {
+		s->free = *linkOf (pool, bp);
+	} else {
+		bp = (address)s + s->first + (size_t)s->capacity++ * pool->objSize;
+		if (pool->ctor != NULL)
+			pool->ctor (bp, pool->arg);
+	}
+	if (++s->used == pool->reserved) {
+		slabRemove (&pool->partial, s);
+		s->full = true;
+		slabPush (&pool->full, s);
+	}
+	return bp;
+}
+
+/*
+ * mm_pool_free - puts ptr back on its slab's free list. ptr must have come
+ * 		from mm_pool_alloc on the same pool.
+ */
+void
+mm_pool_free (mm_pool_t *pool, void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	slab* s = (slab*)((uintptr_t)ptr & ~(uintptr_t)(pool->slabSize - 1));
+	*linkOf (pool, ptr) = s->free;
+	s->free = ptr;
+	if (s->full) {
+		slabRemove (&pool->full, s);
+		s->full = false;
+		slabPush (&pool->partial, s);
+	}
+	if (--s->used == 0 && !pool->cache && (pool->partial != s || s->next != NULL)) {
+		slabRemove (&pool->partial, s);
+		reclaim (pool, s);
+	}
+}
+
+/*
+ * mm_pool_reap - gives every empty slab of the pool back, and every region
+ * 		left with no slab in use to mm_free
+ */
+void
+mm_pool_reap (mm_pool_t *pool)
+{
+	slab* s = pool->partial;
+	while (s != NULL) {
+		slab* next = s->next;
+		if (s->used == 0) {
+			slabRemove (&pool->partial, s);
+			reclaim (pool, s);
+		}
+		s = next;
+	}
+}
+
+/*
+ * mm_pool_destroy - gives every region of the pool, and the pool itself,
+ * 		back to mm_free, destroying every object the pool constructed
+ */
+void
+mm_pool_destroy (mm_pool_t *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	slab* lists[2] = { pool->partial, pool->full };
+	for (int i = 0; i < 2; i++) {
+		slab* s = lists[i];
+		while (s != NULL) {
+			slab* next = s->next;
+			reclaim (pool, s);
+			s = next;
+		}
+	}
+	mm_free (pool);
+}
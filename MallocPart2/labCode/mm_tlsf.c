@@ -0,0 +1,762 @@
+/*
+ * mm_tlsf.c - Two-Level Segregated Fit engine (build with -DMALLOC_LAB_TLSF)
+ *
+ * Blocks use the same boundary tags as mm.c: a 4 byte header right before
+ * the payload and a 4 byte footer at the end of the block, both holding the
+ * block size in words with the low bit set while it is allocated.
+ *
+ * Free blocks live in FL_COUNT x SL_COUNT segregated lists. A first-level
+ * class covers a power of two range of sizes and is split linearly into
+ * SL_COUNT second-level lists. One bitmap says which first-level classes
+ * hold any free block and one per class says which of its lists do, so
+ * finding a fit is a couple of bit scans and malloc, free and coalescing
+ * are all O(1). malloc rounds the request up to the next list boundary
+ * first, so any block in the list it picks is large enough (good fit).
+ *
+ * Built with -DMM_TLSF_SHARED the engine is a heap threads can share. Each
+ * list is guarded by one of LOCK_STRIPES list locks, and the bitmaps are
+ * updated atomically, so malloc and free of different sizes don't wait on
+ * each other. A rwlock over the whole heap is held shared by malloc and free
+ * and exclusively by anything that has to look at a block's neighbours:
+ * extending the heap, realloc and memalign. The lock order is the heap lock,
+ * then at most one list lock, so no two list locks are ever held together.
+ *
+ * In that mode a block's tags only turn free, and a free block only leaves
+ * its list, under the lock of the list its size maps to, with the tags
+ * written there too. A free tag read under that lock therefore means the
+ * block is on that list. free coalesces by claiming each free neighbour in
+ * turn: it reads the neighbour's tag, locks its list, and if the tag still
+ * reads the same it unlinks the neighbour and marks it allocated. The
+ * merged block is then filed under the lock of its own list, and if a
+ * neighbour reads free once it is there, say because another free claimed
+ * the block between them first, it is taken back and merged again. The
+ * split-off rest of a block malloc takes is filed the same way.
+ * Built with -DMM_LOCK_STATS as well, mm_get_stats reports how contended
+ * the locks are.
+ */
+
+#if defined(MM_TLSF_SHARED)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "memlib.h"
+#include "mm.h"
+
+#if defined(MM_TLSF_SHARED)
+#include "mm_lock.h"
+#endif
+
+#define ALIGNMENT 16
+#define WSIZE 8
+#define MIN_BLOCK_SIZE 4
+
+#define SL_LOG 4
+#define SL_COUNT (1 << SL_LOG)
+// Blocks under SMALL_BLOCK words all go to first-level class 0, one list
+// per size, since sizes are always an even number of words
+#define SMALL_BLOCK (SL_COUNT * 2)
+// Enough first-level classes for any block a uint32_t request can make
+#define FL_COUNT 27
+// mem_sbrk takes an int, so no request larger than one call can grow the
+// heap by is served
+#define MAX_REQUEST ((uint32_t)INT_MAX - 2 * ALIGNMENT)
+
+typedef uint64_t word;
+typedef uint32_t tag;
+typedef uint8_t byte;
+typedef byte* address;
+
+static uint32_t fl_bitmap;
+static uint32_t sl_bitmap[FL_COUNT];
+static address free_lists[FL_COUNT][SL_COUNT];
+
+#if defined(MM_TLSF_SHARED)
+#define LOCK_STRIPES 64
+
+typedef struct stripe {
+	_Alignas(MM_CACHELINE) pthread_mutex_t lock;
+	mm_lock_stats_t stats;
+} stripe;
+
+static stripe list_locks[LOCK_STRIPES];
+static pthread_rwlock_t heap_lock = PTHREAD_RWLOCK_INITIALIZER;
+static mm_lock_stats_t heap_lock_stats;
+#endif
+
+#if defined(MM_STATS)
+static mm_stats_t stats;
+#endif
+
+static inline uint32_t sizeOf (tag* base) {
+  return *base & (uint32_t)-2;
+}
+
+static inline bool isAllocated (tag* base) {
+  return *base & (uint32_t)1;
+}
+
+static inline tag* header (address base) {
+  return (tag*)base - 1;
+}
+
+static inline tag* footer (address base) {
+  return (tag*)(base + sizeOf (header (base)) * sizeof (word) - 2 * sizeof (tag));
+}
+
+static inline address nextBlock (address base) {
+  return base + sizeOf (header(base)) * sizeof (word);
+}
+
+static inline tag* prevFooter (address base) {
+  return header(base) - 1;
+}
+
+static inline tag* nextHeader (address base) {
+  return footer(base) + 1;
+}
+
+static inline address prevBlock (address base) {
+  return base - sizeOf (prevFooter (base)) * sizeof(word);
+}
+
+static inline address* nextPtr (address base) {
+  return (address*)base;
+}
+
+static inline address* prevPtr (address base) {
+  return (address*)base + 1;
+}
+
+static inline void setTags (address bp, uint32_t size, bool allocated) {
+	*header(bp) = size | allocated;
+	*footer(bp) = size | allocated;
+}
+
+static inline uint32_t floorLog2 (uint32_t x) {
+	return 31 - (uint32_t)__builtin_clz (x);
+}
+
+/*
+ * mapping - the first- and second-level list a free block of size words
+ * 		belongs in
+ */
+static inline void mapping (uint32_t size, uint32_t* fl, uint32_t* sl) {
+	if (size < SMALL_BLOCK) {
+		*fl = 0;
+		*sl = size / 2;
+	} else {
+		uint32_t f = floorLog2 (size);
+		*fl = f - SL_LOG;
+		*sl = (size >> (f - SL_LOG)) - SL_COUNT;
+	}
+}
+
+/*
+ * mappingSearch - the first list whose blocks are all at least size words
+ */
+static inline void mappingSearch (uint32_t size, uint32_t* fl, uint32_t* sl) {
+	if (size >= SMALL_BLOCK) {
+		size += (1u << (floorLog2 (size) - SL_LOG)) - 1;
+	}
+	mapping (size, fl, sl);
+}
+
+/* Adds a free block to the front of its list */
+static inline void insertBlock (address bp) {
+	uint32_t fl, sl;
+	mapping (sizeOf(header(bp)), &fl, &sl);
+	address head = free_lists[fl][sl];
+	*nextPtr(bp) = head;
+	*prevPtr(bp) = NULL;
+	if (head != NULL)
+		*prevPtr(head) = bp;
+	free_lists[fl][sl] = bp;
+	fl_bitmap |= 1u << fl;
+	sl_bitmap[fl] |= 1u << sl;
+}
+
+/* Unlinks a free block, clearing the bitmaps if its list empties */
+static inline void removeBlock (address bp) {
+	uint32_t fl, sl;
+	mapping (sizeOf(header(bp)), &fl, &sl);
+	address next = *nextPtr(bp);
+	address prev = *prevPtr(bp);
+	if (next != NULL)
+		*prevPtr(next) = prev;
+	if (prev != NULL) {
+		*nextPtr(prev) = next;
+	} else {
+		free_lists[fl][sl] = next;
+		if (next == NULL) {
+			sl_bitmap[fl] &= ~(1u << sl);
+			if (sl_bitmap[fl] == 0)
+				fl_bitmap &= ~(1u << fl);
+		}
+	}
+}
+
+/*
+ * findSuitable - the head of the first non-empty list at or above (fl, sl),
+ * 		or NULL if every such list is empty
+ */
+static inline address findSuitable (uint32_t fl, uint32_t sl) {
+	if (fl >= FL_COUNT)
+		return NULL;
+	uint32_t slMap = sl_bitmap[fl] & (~0u << sl);
+	if (slMap == 0) {
+		uint32_t flMap = fl_bitmap & (~0u << (fl + 1));
+		if (flMap == 0)
+			return NULL;
+		fl = (uint32_t)__builtin_ctz (flMap);
+		slMap = sl_bitmap[fl];
+	}
+	return free_lists[fl][__builtin_ctz (slMap)];
+}
+
+/*
+ * coalesce - merges free block bp with its free neighbours and files the
+ * 		result in its list
+ */
+static inline address coalesce (address bp) {
+	uint32_t size = sizeOf(header(bp));
+	if (!isAllocated(nextHeader(bp))) {
+		size += sizeOf(nextHeader(bp));
+		removeBlock(nextBlock(bp));
+	}
+	if (!isAllocated(prevFooter(bp))) {
+		size += sizeOf(prevFooter(bp));
+		bp = prevBlock(bp);
+		removeBlock(bp);
+	}
+	setTags (bp, size, false);
+	insertBlock (bp);
+	return bp;
+}
+
+#if defined(MM_TLSF_SHARED)
+static inline stripe* listLock (uint32_t fl, uint32_t sl) {
+	return &list_locks[(fl * SL_COUNT + sl) % LOCK_STRIPES];
+}
+
+/*
+ * loadTag, storeTags - tags other threads may read without a lock, to find
+ * 		out whether a neighbour is worth locking a list for
+ */
+static inline tag loadTag (tag* t) {
+	return __atomic_load_n (t, __ATOMIC_RELAXED);
+}
+
+static inline void storeTags (address bp, uint32_t size, bool allocated) {
+	__atomic_store_n (header(bp), size | allocated, __ATOMIC_RELAXED);
+	__atomic_store_n ((tag*)(bp + size * sizeof (word) - 2 * sizeof (tag)), size | allocated, __ATOMIC_RELAXED);
+}
+
+/*
+ * sharedUnlink - takes free block bp off list (fl, sl), whose lock is held,
+ * 		and tags it allocated so no other thread claims it
+ */
+static inline void sharedUnlink (address bp, uint32_t fl, uint32_t sl) {
+	address next = *nextPtr(bp);
+	address prev = *prevPtr(bp);
+	if (next != NULL)
+		*prevPtr(next) = prev;
+	if (prev != NULL) {
+		*nextPtr(prev) = next;
+	} else {
+		free_lists[fl][sl] = next;
+		if (next == NULL)
+			__atomic_fetch_and (&sl_bitmap[fl], ~(1u << sl), __ATOMIC_RELAXED);
+	}
+	storeTags (bp, sizeOf(header(bp)), true);
+}
+
+/*
+ * sharedInsert - tags bp as a free block of size words and files it in its
+ * 		list, both under the list's lock. The first-level bitmap is only ever
+ * 		set here; lockHeap clears its stale bits. If either neighbour reads
+ * 		free once bp is filed, bp is taken back off the list and false is
+ * 		returned so the caller can merge them. The fence makes sure that of
+ * 		two neighbours filed at once, at least one sees the other.
+ */
+static inline bool sharedInsert (address bp, uint32_t size) {
+	uint32_t fl, sl;
+	mapping (size, &fl, &sl);
+	stripe* lock = listLock (fl, sl);
+	lockMutex (&lock->lock, &lock->stats);
+	storeTags (bp, size, false);
+	address head = free_lists[fl][sl];
+	*nextPtr(bp) = head;
+	*prevPtr(bp) = NULL;
+	if (head != NULL)
+		*prevPtr(head) = bp;
+	free_lists[fl][sl] = bp;
+	__atomic_fetch_or (&sl_bitmap[fl], 1u << sl, __ATOMIC_RELAXED);
+	__atomic_fetch_or (&fl_bitmap, 1u << fl, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	tag next = loadTag (header(bp + size * sizeof (word)));
+	tag prev = loadTag (prevFooter(bp));
+	bool alone = isAllocated(&next) && isAllocated(&prev);
+	if (!alone)
+		sharedUnlink (bp, fl, sl);
+	pthread_mutex_unlock (&lock->lock);
+	return alone;
+}
+
+/* Unlinks the head of list (fl, sl), whose lock is held, or returns NULL */
+static inline address sharedPop (uint32_t fl, uint32_t sl, uint32_t atLeast) {
+	address bp = free_lists[fl][sl];
+	if (bp == NULL || sizeOf(header(bp)) < atLeast)
+		return NULL;
+	sharedUnlink (bp, fl, sl);
+	return bp;
+}
+
+/*
+ * sharedTake - takes a free block of at least asize words off the first
+ * 		list that has one, or returns NULL. The bitmaps are read without a
+ * 		lock, so a list may turn out empty once locked; its bit is clear by
+ * 		then and the search moves on.
+ */
+static address sharedTake (uint32_t asize) {
+	uint32_t fl, sl;
+	mappingSearch (asize, &fl, &sl);
+	while (fl < FL_COUNT) {
+		uint32_t slMap = __atomic_load_n (&sl_bitmap[fl], __ATOMIC_RELAXED) & (~0u << sl);
+		if (slMap == 0) {
+			uint32_t flMap = __atomic_load_n (&fl_bitmap, __ATOMIC_RELAXED) & (~0u << (fl + 1));
+			if (flMap == 0)
+				break;
+			fl = (uint32_t)__builtin_ctz (flMap);
+			sl = 0;
+			continue;
+		}
+		sl = (uint32_t)__builtin_ctz (slMap);
+		stripe* lock = listLock (fl, sl);
+		lockMutex (&lock->lock, &lock->stats);
+		address bp = sharedPop (fl, sl, 0);
+		pthread_mutex_unlock (&lock->lock);
+		if (bp != NULL)
+			return bp;
+	}
+	// As in find_fit, asize's own list may still have a head that fits
+	mapping (asize, &fl, &sl);
+	stripe* lock = listLock (fl, sl);
+	lockMutex (&lock->lock, &lock->stats);
+	address bp = sharedPop (fl, sl, asize);
+	pthread_mutex_unlock (&lock->lock);
+	return bp;
+}
+
+/*
+ * claim - takes free block bp off its list if tag t, which is bp's header or
+ * 		footer, still reads seen once the list is locked. Returns whether it
+ * 		did. The tag next to a block the caller owns always belongs to that
+ * 		block's neighbour, so a free tag read under the lock of the list its
+ * 		size maps to is the tag of a block on that list.
+ */
+static inline bool claim (address bp, tag* t, tag seen) {
+	uint32_t fl, sl;
+	mapping (sizeOf(&seen), &fl, &sl);
+	stripe* lock = listLock (fl, sl);
+	lockMutex (&lock->lock, &lock->stats);
+	bool claimed = loadTag (t) == seen;
+	if (claimed)
+		sharedUnlink (bp, fl, sl);
+	pthread_mutex_unlock (&lock->lock);
+	return claimed;
+}
+
+/*
+ * sharedFile - merges block bp of size words, which the caller owns, with
+ * 		whichever neighbours it can claim and files the result in its list,
+ * 		merging again while a neighbour turns free as it is filed
+ */
+static void sharedFile (address bp, uint32_t size) {
+	do {
+		address next = bp + size * sizeof (word);
+		tag seen = loadTag (header(next));
+		if (!isAllocated(&seen) && claim (next, header(next), seen))
+			size += sizeOf(&seen);
+		seen = loadTag (prevFooter(bp));
+		if (!isAllocated(&seen)) {
+			address prev = bp - sizeOf(&seen) * sizeof (word);
+			if (claim (prev, prevFooter(bp), seen)) {
+				size += sizeOf(&seen);
+				bp = prev;
+			}
+		}
+	} while (!sharedInsert (bp, size));
+}
+#endif
+
+/*
+ * lockHeap, unlockHeap - hold the heap lock exclusively around the parts of
+ * 		the engine written for one thread. Taking it clears the first-level
+ * 		bits sharedTake left set over emptied classes.
+ */
+static inline void lockHeap (void) {
+#if defined(MM_TLSF_SHARED)
+	lockWrite (&heap_lock, &heap_lock_stats);
+	fl_bitmap = 0;
+	for (uint32_t fl = 0; fl < FL_COUNT; fl++)
+		if (sl_bitmap[fl] != 0)
+			fl_bitmap |= 1u << fl;
+#endif
+}
+
+static inline void unlockHeap (void) {
+#if defined(MM_TLSF_SHARED)
+	pthread_rwlock_unlock (&heap_lock);
+#endif
+}
+
+/*
+ * blocksFromBytes - the block size in words for a payload of bytes, keeping
+ * 		every payload 16 byte aligned
+ */
+static inline uint32_t blocksFromBytes (uint32_t bytes) {
+	uint32_t size = (uint32_t) ((bytes + 2*sizeof(tag) + ALIGNMENT - 1) / ALIGNMENT )* 2;
+	if (size < MIN_BLOCK_SIZE)
+		return MIN_BLOCK_SIZE;
+	return size;
+}
+
+/*
+ * extend_heap - makes a free block of at least words at the end of the heap
+ * 		and returns it. A free block already at the end only has to grow by
+ * 		the difference.
+ */
+static inline address extend_heap (uint32_t words) {
+	address end = (address)mem_heap_hi() + 1;
+	tag* lastFooter = (tag*)end - 2;
+	if (!isAllocated(lastFooter)) {
+		if (sizeOf(lastFooter) >= words)
+			return end - sizeOf(lastFooter) * WSIZE;
+		words -= sizeOf(lastFooter);
+	}
+	words += (words & 1);
+	uintptr_t bytes = (uintptr_t)words * WSIZE;
+	if (bytes > INT_MAX)
+		return NULL;
+	address bp = mem_sbrk ((int)bytes);
+	if ((uint64_t)bp == (uint64_t)-1)
+		return NULL;
+	setTags (bp, words, false);
+	*header (nextBlock (bp)) = 0 | true;
+	return coalesce (bp);
+}
+
+/*
+ * carve - allocates asize words at the start of free block bp, returning
+ * 		the rest to the free lists when it is large enough
+ */
+static inline address carve (address bp, uint32_t asize) {
+	uint32_t csize = sizeOf(header(bp));
+	removeBlock (bp);
+	if (csize - asize >= MIN_BLOCK_SIZE) {
+		setTags (bp, asize, true);
+		setTags (nextBlock (bp), csize - asize, false);
+		insertBlock (nextBlock (bp));
+	} else {
+		setTags (bp, csize, true);
+	}
+	return bp;
+}
+
+/*
+ * find_fit - a free block of at least asize words, growing the heap if no
+ * 		list has one
+ */
+static inline address find_fit (uint32_t asize) {
+	uint32_t fl, sl;
+#if defined(MM_STATS)
+	uint64_t start = __rdtsc ();
+#endif
+	mappingSearch (asize, &fl, &sl);
+	address bp = findSuitable (fl, sl);
+	if (bp == NULL) {
+		// The rounded-up search skips asize's own list, whose head may
+		// still fit; checking just the head keeps this O(1)
+		mapping (asize, &fl, &sl);
+		bp = free_lists[fl][sl];
+		if (bp != NULL && sizeOf(header(bp)) < asize)
+			bp = NULL;
+	}
+#if defined(MM_STATS)
+	stats.fit_calls++;
+	stats.fit_cycles += __rdtsc () - start;
+#endif
+	if (bp != NULL)
+		return bp;
+	return extend_heap (asize);
+}
+
+int
+mm_init (void)
+{
+	fl_bitmap = 0;
+	memset (sl_bitmap, 0, sizeof(sl_bitmap));
+	memset (free_lists, 0, sizeof(free_lists));
+#if defined(MM_STATS)
+	memset (&stats, 0, sizeof(stats));
+#endif
+#if defined(MM_TLSF_SHARED)
+	for (uint32_t i = 0; i < LOCK_STRIPES; i++) {
+		pthread_mutex_init (&list_locks[i].lock, NULL);
+		memset (&list_locks[i].stats, 0, sizeof(mm_lock_stats_t));
+	}
+	memset (&heap_lock_stats, 0, sizeof(mm_lock_stats_t));
+#endif
+	// A prologue footer and an epilogue header, so the first block's
+	// payload lands 16 byte aligned and both of its neighbours look allocated
+	address heap_head = mem_sbrk (2 * WSIZE);
+	if (heap_head == (void *)-1)
+		return -1;
+	*(tag*)(heap_head + WSIZE) = 0 | true;
+	*(tag*)(heap_head + WSIZE + sizeof(tag)) = 0 | true;
+	return 0;
+}
+
+void*
+mm_malloc (uint32_t size)
+{
+	if (size == 0 || size > MAX_REQUEST) {
+		return NULL;
+	}
+	uint32_t asize = blocksFromBytes(size);
+#if defined(MM_TLSF_SHARED)
+	lockRead (&heap_lock, &heap_lock_stats);
+	address bp = sharedTake (asize);
+	if (bp != NULL) {
+		// sharedTake tagged the whole block allocated
+		uint32_t csize = sizeOf(header(bp));
+		if (csize - asize >= MIN_BLOCK_SIZE) {
+			storeTags (bp, asize, true);
+			sharedFile (bp + asize * sizeof (word), csize - asize);
+		}
+	}
+	pthread_rwlock_unlock (&heap_lock);
+	if (bp != NULL) {
+		return bp;
+	}
+	lockHeap ();
+	bp = find_fit (asize);
+	if (bp != NULL)
+		bp = carve (bp, asize);
+	unlockHeap ();
+	return bp;
+#else
+	address bp = find_fit(asize);
+	if (bp == NULL) {
+		return NULL;
+	}
+	return carve(bp, asize);
+#endif
+}
+
+void*
+mm_memalign (uint32_t alignment, uint32_t size)
+{
+	if (alignment <= ALIGNMENT) {
+		return mm_malloc (size);
+	}
+	if (size == 0 || size > MAX_REQUEST || (alignment & (alignment - 1)) != 0) {
+		return NULL;
+	}
+	// Any block this big has an aligned spot with room for a free block
+	// in front of it
+	uint32_t asize = blocksFromBytes(size);
+	lockHeap ();
+	address bp = find_fit (asize + alignment / WSIZE + MIN_BLOCK_SIZE);
+	if (bp == NULL) {
+		unlockHeap ();
+		return NULL;
+	}
+	uintptr_t gap = (alignment - (uintptr_t)bp % alignment) % alignment;
+	while (gap != 0 && gap < MIN_BLOCK_SIZE * WSIZE)
+		gap += alignment;
+	if (gap != 0) {
+		uint32_t skip = (uint32_t)(gap / WSIZE);
+		uint32_t csize = sizeOf(header(bp));
+		removeBlock (bp);
+		setTags (bp, skip, false);
+		insertBlock (bp);
+		bp = nextBlock (bp);
+		setTags (bp, csize - skip, false);
+		insertBlock (bp);
+	}
+	bp = carve (bp, asize);
+	unlockHeap ();
+	return bp;
+}
+
+void*
+mm_malloc_cacheline (uint32_t size)
+{
+	return mm_memalign (MM_CACHELINE, (size + MM_CACHELINE - 1) & ~(uint32_t)(MM_CACHELINE - 1));
+}
+
+void
+mm_free (void *ptr)
+{
+	if (ptr == NULL) {
+		return;
+	}
+	address bp = (address)ptr;
+#if defined(MM_TLSF_SHARED)
+	lockRead (&heap_lock, &heap_lock_stats);
+	sharedFile (bp, sizeOf(header(bp)));
+	pthread_rwlock_unlock (&heap_lock);
+#else
+	setTags (bp, sizeOf(header(bp)), false);
+	coalesce (bp);
+#endif
+}
+
+/*
+ * resizeInPlace - shrinks block bp to newBlocks words, or grows it into a
+ * 		free neighbour and/or the end of the heap. Returns false when it
+ * 		would have to move.
+ */
+static inline bool resizeInPlace (address bp, uint32_t newBlocks) {
+	const uint32_t oldBlocks = sizeOf(header(bp));
+	if (newBlocks <= oldBlocks) {
+		if (oldBlocks - newBlocks >= MIN_BLOCK_SIZE) {
+			setTags (bp, newBlocks, true);
+			setTags (nextBlock (bp), oldBlocks - newBlocks, false);
+			coalesce (nextBlock (bp));
+		}
+		return true;
+	}
+	uint32_t avail = oldBlocks;
+	address next = nextBlock (bp);
+	if (!isAllocated(header(next))) {
+		avail += sizeOf(header(next));
+		next = nextBlock (next);
+	}
+	if (avail < newBlocks && sizeOf(header(next)) != 0)
+		return false;
+	if (avail < newBlocks) {
+		uint32_t words = newBlocks - avail;
+		uintptr_t bytes = (uintptr_t)words * WSIZE;
+		if (bytes > INT_MAX || mem_sbrk ((int)bytes) == (void *)-1)
+			return false;
+		*header (next + words * WSIZE) = 0 | true;
+		avail = newBlocks;
+	}
+	if (!isAllocated(nextHeader(bp))) {
+		removeBlock (nextBlock (bp));
+	}
+	if (avail - newBlocks >= MIN_BLOCK_SIZE) {
+		setTags (bp, newBlocks, true);
+		setTags (nextBlock (bp), avail - newBlocks, false);
+		insertBlock (nextBlock (bp));
+	} else {
+		setTags (bp, avail, true);
+	}
+	return true;
+}
+
+void*
+mm_realloc (void *ptr, uint32_t size)
+{
+	if (ptr == NULL) {
+		return mm_malloc (size);
+	}
+	if (size == 0) {
+		mm_free (ptr);
+		return NULL;
+	}
+	if (size > MAX_REQUEST) {
+		return NULL;
+	}
+	address bp = (address)ptr;
+	const uint32_t oldBlocks = sizeOf(header(bp));
+	const uint32_t payload = (uint32_t)(oldBlocks * sizeof(word) - 2 * sizeof(tag));
+	lockHeap ();
+	bool resized = resizeInPlace (bp, blocksFromBytes (size));
+	unlockHeap ();
+	if (resized) {
+		return ptr;
+	}
+	address newPtr = mm_malloc (size);
+	if (newPtr == NULL) {
+		return NULL;
+	}
+	memcpy (newPtr, ptr, payload);
+#if defined(MM_STATS)
+	stats.realloc_copied += payload;
+#endif
+	mm_free (ptr);
+	return newPtr;
+}
+
+void
+mm_get_stats (mm_stats_t *out)
+{
+#if defined(MM_STATS)
+	*out = stats;
+#else
+	memset (out, 0, sizeof(*out));
+#endif
+#if defined(MM_TLSF_SHARED)
+	out->heap_lock = heap_lock_stats;
+	memset (&out->list_locks, 0, sizeof(mm_lock_stats_t));
+	for (uint32_t i = 0; i < LOCK_STRIPES; i++)
+		addLockStats (&out->list_locks, &list_locks[i].stats);
+#endif
+}
+
+int mm_check(void)
+{
+	address bp = (address)mem_heap_lo() + 2 * WSIZE;
+	uint32_t freeBlocks = 0;
+	for (; sizeOf(header(bp)) != 0; bp = nextBlock(bp)) {
+		// The header and footer disagree
+		if (*header(bp) != *footer(bp))
+			return 0;
+		if (!isAllocated(header(bp))) {
+			// Two free blocks in a row, you missed a coalesce
+			if (!isAllocated(nextHeader(bp)))
+				return 0;
+			freeBlocks++;
+		}
+	}
+	// Every list holds only free blocks of its own class, the bitmaps match
+	// the lists, and together they hold every free block
+	for (uint32_t fl = 0; fl < FL_COUNT; fl++) {
+		for (uint32_t sl = 0; sl < SL_COUNT; sl++) {
+			bool listed = free_lists[fl][sl] != NULL;
+			if (listed != (bool)(sl_bitmap[fl] & (1u << sl)))
+				return 0;
+			for (address p = free_lists[fl][sl]; p != NULL; p = *nextPtr(p)) {
+				uint32_t f, s;
+				mapping (sizeOf(header(p)), &f, &s);
+				if (isAllocated(header(p)) || f != fl || s != sl)
+					return 0;
+				freeBlocks--;
+			}
+		}
+#if defined(MM_TLSF_SHARED)
+		// sharedTake leaves first-level bits set over emptied classes
+		if (sl_bitmap[fl] != 0 && !(fl_bitmap & (1u << fl)))
+			return 0;
+#else
+		if ((sl_bitmap[fl] != 0) != (bool)(fl_bitmap & (1u << fl)))
+			return 0;
+#endif
+	}
+	return freeBlocks == 0;
+}